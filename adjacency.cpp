@@ -0,0 +1,253 @@
+#include "adjacency.hpp"
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+static uint32_t round_up_pow2(uint32_t n) {
+  uint32_t p = 1;
+  while (p < n) {
+    p <<= 1;
+  }
+  return p;
+}
+
+neighbor_set::neighbor_set(const neighbor_set& other) : sz(0), cap(ADJ_INLINE_NEIGHBORS) {
+  if (other.sz > ADJ_INLINE_NEIGHBORS) {
+    grow(other.cap);
+  }
+  memcpy(data(), other.data(), other.sz * sizeof(uint64_t));
+  sz = other.sz;
+  if (has_index()) {
+    rebuild_index();
+  }
+}
+
+neighbor_set::neighbor_set(neighbor_set&& other) noexcept : sz(other.sz), cap(other.cap) {
+  if (other.is_inline()) {
+    memcpy(inline_ids, other.inline_ids, sizeof(inline_ids));
+  }else {
+    heap_ids = other.heap_ids;
+  }
+  other.sz = 0;
+  other.cap = ADJ_INLINE_NEIGHBORS;
+}
+
+neighbor_set::~neighbor_set() {
+  if (!is_inline()) {
+    free(heap_ids);
+  }
+}
+
+void neighbor_set::swap(neighbor_set& other) noexcept {
+  //the union holds either the inline ids or the heap pointer, swap it bytewise
+  uint64_t tmp[ADJ_INLINE_NEIGHBORS];
+  memcpy(tmp, inline_ids, sizeof(tmp));
+  memcpy(inline_ids, other.inline_ids, sizeof(tmp));
+  memcpy(other.inline_ids, tmp, sizeof(tmp));
+  std::swap(sz, other.sz);
+  std::swap(cap, other.cap);
+}
+
+const uint64_t* neighbor_set::find(uint64_t id) const {
+  const uint64_t* ids = data();
+  if (!has_index()) {
+    for (uint32_t i = 0; i < sz; ++i) {
+      if (ids[i] == id) {
+        return ids + i;
+      }
+    }
+    return ids + sz;
+  }
+  uint32_t* idx = index();
+  uint32_t slot = index_lookup(idx, index_mask(), id, [ids](uint32_t pos) { return ids[pos]; });
+  return idx[slot] == 0 ? ids + sz : ids + idx[slot] - 1;
+}
+
+bool neighbor_set::insert(uint64_t id) {
+  if (find(id) != end()) {
+    return false;
+  }
+  if (sz == cap) {
+    grow(cap * 2);
+  }
+  data()[sz] = id;
+  if (has_index()) {
+    index_insert(index(), index_mask(), id, sz);
+  }
+  sz++;
+  return true;
+}
+
+size_t neighbor_set::erase(uint64_t id) {
+  uint64_t* ids = data();
+  uint32_t last = sz - 1;
+  if (!has_index()) {
+    for (uint32_t i = 0; i < sz; ++i) {
+      if (ids[i] == id) {
+        ids[i] = ids[last];
+        sz--;
+        return 1;
+      }
+    }
+    return 0;
+  }
+  uint32_t* idx = index();
+  uint32_t mask = index_mask();
+  auto key_at = [ids](uint32_t pos) { return ids[pos]; };
+  uint32_t slot = index_lookup(idx, mask, id, key_at);
+  if (idx[slot] == 0) {
+    return 0;
+  }
+  uint32_t pos = idx[slot] - 1;
+  index_erase(idx, mask, slot, key_at);
+  if (pos != last) {
+    //move the last id into the hole and repoint its index slot
+    uint32_t moved = index_lookup(idx, mask, ids[last], key_at);
+    idx[moved] = pos + 1;
+    ids[pos] = ids[last];
+  }
+  sz--;
+  return 1;
+}
+
+void neighbor_set::reserve(uint32_t n) {
+  if (n > cap) {
+    grow(round_up_pow2(n));
+  }
+}
+
+void neighbor_set::clear() {
+  if (!is_inline()) {
+    free(heap_ids);
+  }
+  sz = 0;
+  cap = ADJ_INLINE_NEIGHBORS;
+}
+
+size_t neighbor_set::heap_bytes() const {
+  if (is_inline()) {
+    return 0;
+  }
+  return cap * sizeof(uint64_t) + (has_index() ? cap * 2 * sizeof(uint32_t) : 0);
+}
+
+void neighbor_set::grow(uint32_t new_cap) {
+  size_t bytes = new_cap * sizeof(uint64_t);
+  if (new_cap > ADJ_INDEX_THRESHOLD) {
+    bytes += new_cap * 2 * sizeof(uint32_t);
+  }
+  uint64_t* new_ids = (uint64_t*)malloc(bytes);
+  memcpy(new_ids, data(), sz * sizeof(uint64_t));
+  if (!is_inline()) {
+    free(heap_ids);
+  }
+  heap_ids = new_ids;
+  cap = new_cap;
+  if (has_index()) {
+    rebuild_index();
+  }
+}
+
+void neighbor_set::rebuild_index() {
+  uint32_t* idx = index();
+  uint32_t mask = index_mask();
+  memset(idx, 0, cap * 2 * sizeof(uint32_t));
+  for (uint32_t i = 0; i < sz; ++i) {
+    index_insert(idx, mask, heap_ids[i], i);
+  }
+}
+
+uint32_t adjacency_map::lookup_slot(uint64_t id) const {
+  const vector<value_type>& e = entries;
+  return index_lookup(index.data(), (uint32_t)index.size() - 1, id,
+      [&e](uint32_t pos) { return e[pos].first; });
+}
+
+adjacency_map::iterator adjacency_map::find(uint64_t id) {
+  if (entries.empty()) {
+    return entries.end();
+  }
+  uint32_t slot = lookup_slot(id);
+  return index[slot] == 0 ? entries.end() : entries.begin() + (index[slot] - 1);
+}
+
+adjacency_map::const_iterator adjacency_map::find(uint64_t id) const {
+  if (entries.empty()) {
+    return entries.end();
+  }
+  uint32_t slot = lookup_slot(id);
+  return index[slot] == 0 ? entries.end() : entries.begin() + (index[slot] - 1);
+}
+
+neighbor_set& adjacency_map::operator[](uint64_t id) {
+  if (!entries.empty()) {
+    uint32_t slot = lookup_slot(id);
+    if (index[slot] != 0) {
+      return entries[index[slot] - 1].second;
+    }
+  }
+  //keep the load factor of the index at most 1/2
+  if ((entries.size() + 1) * 2 > index.size()) {
+    rehash(index.empty() ? 16 : index.size() * 2);
+  }
+  index_insert(index.data(), (uint32_t)index.size() - 1, id, (uint32_t)entries.size());
+  entries.push_back(make_pair(id, neighbor_set()));
+  return entries.back().second;
+}
+
+size_t adjacency_map::erase(uint64_t id) {
+  if (entries.empty()) {
+    return 0;
+  }
+  const vector<value_type>& e = entries;
+  auto key_at = [&e](uint32_t pos) { return e[pos].first; };
+  uint32_t mask = (uint32_t)index.size() - 1;
+  uint32_t slot = index_lookup(index.data(), mask, id, key_at);
+  if (index[slot] == 0) {
+    return 0;
+  }
+  uint32_t pos = index[slot] - 1;
+  uint32_t last = (uint32_t)entries.size() - 1;
+  index_erase(index.data(), mask, slot, key_at);
+  if (pos != last) {
+    //move the last vertex into the hole and repoint its index slot
+    uint32_t moved = index_lookup(index.data(), mask, entries[last].first, key_at);
+    index[moved] = pos + 1;
+    entries[pos] = std::move(entries[last]);
+  }
+  entries.pop_back();
+  return 1;
+}
+
+void adjacency_map::reserve(size_t n) {
+  entries.reserve(n);
+  if (n * 2 > index.size()) {
+    rehash(round_up_pow2((uint32_t)(n * 2)));
+  }
+}
+
+void adjacency_map::clear() {
+  entries.clear();
+  index.clear();
+}
+
+size_t adjacency_map::memory_usage() const {
+  size_t bytes = entries.capacity() * sizeof(value_type) + index.capacity() * sizeof(uint32_t);
+  for (const value_type& p : entries) {
+    bytes += p.second.heap_bytes();
+  }
+  return bytes;
+}
+
+void adjacency_map::rehash(size_t index_size) {
+  index.assign(index_size, 0);
+  uint32_t mask = (uint32_t)index_size - 1;
+  for (uint32_t i = 0; i < entries.size(); ++i) {
+    index_insert(index.data(), mask, entries[i].first, i);
+  }
+}
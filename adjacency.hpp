@@ -0,0 +1,184 @@
+#ifndef _ADJACENCY_H
+#define _ADJACENCY_H
+
+#include <cstdint>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+//neighbors kept inside the neighbor_set itself before spilling to the heap
+#define ADJ_INLINE_NEIGHBORS 2
+//degree above which a neighbor_set keeps a hash index next to its id array
+#define ADJ_INDEX_THRESHOLD 32
+
+static inline uint64_t adj_hash(uint64_t x) {
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return x;
+}
+
+//open-addressing (linear probing) index over a dense array.
+//every slot holds the array position + 1, 0 marks an empty slot.
+//return the slot holding key, or the empty slot where key would go
+template <typename KeyAt>
+static inline uint32_t index_lookup(const uint32_t* index, uint32_t mask, uint64_t key, KeyAt key_at) {
+  uint32_t h = (uint32_t)adj_hash(key) & mask;
+  while (index[h] != 0 && key_at(index[h] - 1) != key) {
+    h = (h + 1) & mask;
+  }
+  return h;
+}
+
+static inline void index_insert(uint32_t* index, uint32_t mask, uint64_t key, uint32_t pos) {
+  uint32_t h = (uint32_t)adj_hash(key) & mask;
+  while (index[h] != 0) {
+    h = (h + 1) & mask;
+  }
+  index[h] = pos + 1;
+}
+
+//clear a slot with backward shift deletion, so no tombstones are needed
+template <typename KeyAt>
+static inline void index_erase(uint32_t* index, uint32_t mask, uint32_t slot, KeyAt key_at) {
+  uint32_t i = slot;
+  uint32_t j = slot;
+  while (true) {
+    j = (j + 1) & mask;
+    if (index[j] == 0) {
+      break;
+    }
+    uint32_t home = (uint32_t)adj_hash(key_at(index[j] - 1)) & mask;
+    //the entry at j can stay if its home slot lies cyclically in (i, j]
+    bool stays = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+    if (!stays) {
+      index[i] = index[j];
+      i = j;
+    }
+  }
+  index[i] = 0;
+}
+
+//set of neighbor ids stored as one contiguous array, small sets live inline,
+//large sets carry an open-addressing index at the tail of the same allocation
+class neighbor_set {
+  public:
+    typedef const uint64_t* iterator;
+    typedef const uint64_t* const_iterator;
+
+    neighbor_set() : sz(0), cap(ADJ_INLINE_NEIGHBORS) {}
+
+    neighbor_set(const neighbor_set& other);
+
+    neighbor_set(neighbor_set&& other) noexcept;
+
+    neighbor_set& operator=(neighbor_set other) noexcept {
+      swap(other);
+      return *this;
+    }
+
+    ~neighbor_set();
+
+    void swap(neighbor_set& other) noexcept;
+
+    size_t size() const { return sz; }
+
+    bool empty() const { return sz == 0; }
+
+    const uint64_t* begin() const { return data(); }
+
+    const uint64_t* end() const { return data() + sz; }
+
+    const uint64_t* find(uint64_t id) const;
+
+    //return true if the id was not in the set
+    bool insert(uint64_t id);
+
+    //return the number of removed ids (0 or 1)
+    size_t erase(uint64_t id);
+
+    void reserve(uint32_t n);
+
+    void clear();
+
+    //bytes owned by this set outside of the object itself
+    size_t heap_bytes() const;
+
+  private:
+    uint32_t sz;
+    uint32_t cap;
+    union {
+      uint64_t inline_ids[ADJ_INLINE_NEIGHBORS];
+      uint64_t* heap_ids;
+    };
+
+    bool is_inline() const { return cap <= ADJ_INLINE_NEIGHBORS; }
+
+    bool has_index() const { return cap > ADJ_INDEX_THRESHOLD; }
+
+    uint32_t index_mask() const { return cap * 2 - 1; }
+
+    uint64_t* data() { return is_inline() ? inline_ids : heap_ids; }
+
+    const uint64_t* data() const { return is_inline() ? inline_ids : heap_ids; }
+
+    uint32_t* index() const { return (uint32_t*)(heap_ids + cap); }
+
+    void grow(uint32_t new_cap);
+
+    void rebuild_index();
+};
+
+//vertex table: dense array of <vertex, neighbors> entries plus an
+//open-addressing index from vertex id to array position.
+//erase moves the last entry into the hole, so iterators are invalidated by
+//insertion and removal, and entry order is unspecified
+class adjacency_map {
+  public:
+    typedef pair<uint64_t, neighbor_set> value_type;
+    typedef neighbor_set mapped_type;
+    typedef vector<value_type>::iterator iterator;
+    typedef vector<value_type>::const_iterator const_iterator;
+
+    iterator begin() { return entries.begin(); }
+
+    iterator end() { return entries.end(); }
+
+    const_iterator begin() const { return entries.begin(); }
+
+    const_iterator end() const { return entries.end(); }
+
+    size_t size() const { return entries.size(); }
+
+    bool empty() const { return entries.empty(); }
+
+    iterator find(uint64_t id);
+
+    const_iterator find(uint64_t id) const;
+
+    //insert an empty neighbor set if the vertex doesn't exist
+    neighbor_set& operator[](uint64_t id);
+
+    size_t erase(uint64_t id);
+
+    void reserve(size_t n);
+
+    void clear();
+
+    //approximate bytes used by the table and all neighbor sets
+    size_t memory_usage() const;
+
+  private:
+    vector<value_type> entries;
+    vector<uint32_t> index;
+
+    uint32_t lookup_slot(uint64_t id) const;
+
+    void rehash(size_t index_size);
+};
+
+#endif
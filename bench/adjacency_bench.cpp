@@ -0,0 +1,115 @@
+// Memory per edge and BFS throughput of the adjacency backend of Graph on a
+// random graph. Build it once per backend and compare the two runs:
+//   adjacency_bench_compact   COMPACT_ADJACENCY=1, adjacency_map/neighbor_set
+//   adjacency_bench_std       COMPACT_ADJACENCY=0, unordered_map/unordered_set
+//
+// Memory is the growth of the malloc heap while the graph is built, so it
+// includes the allocator overhead of every hash node. BFS throughput is
+// measured with full single source traversals (visited kept in a flat array
+// indexed by vertex id, so the time goes to the adjacency) and with
+// Graph::shortestPath between random vertex pairs.
+//
+// usage: make adjacency_bench
+//        ./adjacency_bench_compact [vertices] [edges] [queries]
+//        ./adjacency_bench_std [vertices] [edges] [queries]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <malloc.h>
+#include <random>
+#include <unordered_set>
+#include <vector>
+
+#include "graph.hpp"
+
+using namespace std;
+
+typedef chrono::steady_clock bench_clock;
+
+static size_t heap_in_use() {
+  struct mallinfo2 mi = mallinfo2();
+  return mi.uordblks + mi.hblkhd;
+}
+
+//visit every vertex reachable from source, return the number of edges scanned
+static uint64_t bfs(adjacency_t& g, uint64_t source, vector<char>& visited, vector<uint64_t>& queue) {
+  fill(visited.begin(), visited.end(), 0);
+  queue.clear();
+  queue.push_back(source);
+  visited[source] = 1;
+  uint64_t scanned = 0;
+  for (size_t head = 0; head < queue.size(); ++head) {
+    neighbor_set_t& neighbors = g.find(queue[head])->second;
+    for (auto iter = neighbors.begin(); iter != neighbors.end(); ++iter) {
+      scanned++;
+      if (!visited[*iter]) {
+        visited[*iter] = 1;
+        queue.push_back(*iter);
+      }
+    }
+  }
+  return scanned;
+}
+
+int main(int argc, char** argv) {
+  uint64_t vertices = argc > 1 ? strtoull(argv[1], nullptr, 10) : 1000000;
+  uint64_t edges = argc > 2 ? strtoull(argv[2], nullptr, 10) : 10000000;
+  uint32_t queries = argc > 3 ? strtoul(argv[3], nullptr, 10) : 1000;
+  if (vertices < 2) {
+    vertices = 2;
+  }
+  fprintf(stderr, "%s adjacency, %llu vertices, %llu edges\n", COMPACT_ADJACENCY ? "compact" : "std",
+      (unsigned long long)vertices, (unsigned long long)edges);
+
+  mt19937_64 rng(426);
+  size_t heap_before = heap_in_use();
+  Graph graph;
+  bench_clock::time_point start = bench_clock::now();
+  for (uint64_t v = 0; v < vertices; ++v) {
+    graph.addNode(v);
+  }
+  uint64_t added = 0;
+  while (added < edges) {
+    if (graph.addEdge(rng() % vertices, rng() % vertices) == 200) {
+      added++;
+    }
+  }
+  double build_ms = chrono::duration<double, milli>(bench_clock::now() - start).count();
+  //the checkpoint dirty set isn't part of the adjacency
+  graph.dirty.clear();
+  unordered_set<uint64_t>().swap(graph.dirty);
+  malloc_trim(0);
+  size_t heap_bytes = heap_in_use() - heap_before;
+  fprintf(stderr, "build       %10.1f ms  %8.1f bytes per edge\n", build_ms, (double)heap_bytes / edges);
+
+  vector<char> visited(vertices);
+  vector<uint64_t> queue;
+  queue.reserve(vertices);
+  uint64_t scanned = 0;
+  uint32_t traversals = 0;
+  start = bench_clock::now();
+  double bfs_ms = 0;
+  while (traversals < 3 or bfs_ms < 1000) {
+    scanned += bfs(graph.g, rng() % vertices, visited, queue);
+    traversals++;
+    bfs_ms = chrono::duration<double, milli>(bench_clock::now() - start).count();
+  }
+  fprintf(stderr, "bfs         %10.1f ms  %8.1f M edges/s (%u traversals)\n", bfs_ms / traversals,
+      scanned / bfs_ms / 1000, traversals);
+
+  uint64_t total_dist = 0;
+  start = bench_clock::now();
+  for (uint32_t i = 0; i < queries; ++i) {
+    pair<int, int> res = graph.shortestPath(rng() % vertices, rng() % vertices);
+    if (res.first == 200) {
+      total_dist += res.second;
+    }
+  }
+  double path_ms = chrono::duration<double, milli>(bench_clock::now() - start).count();
+  fprintf(stderr, "shortest    %10.3f ms  %8.0f paths/s (mean distance %.2f)\n", path_ms / queries,
+      queries / path_ms * 1000, queries ? (double)total_dist / queries : 0.0);
+  return 0;
+}
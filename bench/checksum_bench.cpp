@@ -0,0 +1,211 @@
+// Throughput of the block checksums and the corruptions each of them
+// catches. Checksums a buffer of log blocks over and over and reports the
+// time per GB, then corrupts checksummed log blocks in ways a disk or a
+// crash does and counts how many corruptions every checksum detects:
+//   bit flip      one flipped bit
+//   column flips  the same bit flipped in two 64-bit words
+//   word swap     two 64-bit words trade places (reordered writes)
+//   torn sector   one 512-byte sector still holds the previous version of
+//                 the block, the rest the new one
+//   zero sector   one 512-byte sector reads back as zeros
+// Exits 1 if crc32c misses any of these corruptions, or if the crc32
+// instruction and the lookup tables disagree with the check value
+// crc32c("123456789") = 0xe3069283 or with each other.
+//
+// usage: make checksum_bench
+//        ./checksum_bench [megabytes] [trials]
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "checksum.hpp"
+#include "log.hpp"
+#include "types.hpp"
+
+using namespace std;
+
+static const uint32_t types[] = {CHECKSUM_XOR, CHECKSUM_CRC32C};
+static const char* type_names[] = {"xor", "crc32c"};
+
+//a log block of varint entries, n of them taken from rng. return the bytes
+//its checksum covers
+static uint32_t make_block(log_block_t* lb, mt19937_64& rng, uint32_t n, uint32_t type) {
+  lb->clear();
+  lb->generation_num = 7;
+  lb->format = LOG_FORMAT_VARINT;
+  lb->checksum_type = type;
+  log_cursor_t cursor;
+  for (uint32_t i = 0; i < n && lb->room(cursor) > 0; ++i) {
+    lb->append(log_entry_t(OP_ADD_EDGE, rng() % 1000000, rng() % 1000000), &cursor);
+  }
+  lb->checksum = lb->compute_checksum(cursor);
+  return offsetof(log_block_t, data) + lb->used_bytes(cursor);
+}
+
+//crc32c, crc32c_sw and crc32c_halves against the check value and each
+//other on random buffers, return whether they all agree
+static bool check_crc32c() {
+  const char* check = "123456789";
+  uint32_t hw = crc32c(0, check, 9);
+  uint32_t sw = crc32c_sw(0, check, 9);
+  uint32_t split = crc32c(crc32c(0, check, 4), check + 4, 5);
+  bool ok = hw == 0xe3069283 && sw == 0xe3069283 && split == 0xe3069283;
+  fprintf(stderr, "crc32c check value %08x, lookup tables %08x, in two parts %08x\n", hw, sw, split);
+  mt19937_64 rng(1);
+  vector<uint8_t> buf(BLOCK_SIZE + 8);
+  uint32_t mismatches = 0;
+  for (uint32_t i = 0; i < 100000; ++i) {
+    for (uint8_t& b : buf) {
+      b = (uint8_t)rng();
+    }
+    //unaligned starts and odd lengths take the byte loops too
+    size_t start = rng() % 8;
+    size_t len = rng() % (BLOCK_SIZE + 1);
+    const uint8_t* p = buf.data() + start;
+    uint32_t crc = (uint32_t)rng();
+    size_t half = len / 2;
+    uint64_t halves = (uint64_t)crc32c_sw(0, p, half) << 32 | crc32c_sw(0, p + half, len - half);
+    if (crc32c(crc, p, len) != crc32c_sw(crc, p, len) || crc32c_halves(p, len) != halves) {
+      mismatches++;
+    }
+  }
+  fprintf(stderr, "crc32c paths disagree on %u of 100000 buffers\n", mismatches);
+  return ok && mismatches == 0;
+}
+
+static void throughput(size_t megabytes) {
+  size_t n = megabytes * 1024 * 1024 / BLOCK_SIZE;
+  vector<log_block_t> blocks(n);
+  mt19937_64 rng(1);
+  for (log_block_t& lb : blocks) {
+    make_block(&lb, rng, 1000, CHECKSUM_XOR);
+  }
+  //at least 4 GB per checksum
+  size_t rounds = (4096 + megabytes - 1) / megabytes;
+  double gb = (double)rounds * n * BLOCK_SIZE / 1e9;
+  fprintf(stderr, "crc32c runs on the %s\n", crc32c_hardware() ? "SSE4.2 crc32 instruction" : "lookup tables");
+  for (int t = 0; t < 3; ++t) {
+    uint64_t sink = 0;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (size_t r = 0; r < rounds; ++r) {
+      for (log_block_t& lb : blocks) {
+        if (t < 2) {
+          sink += compute_block_checksum(&lb, types[t]);
+        }else {
+          //one crc chain over the whole block, for comparison
+          sink += crc32c(0, (uint8_t*)&lb + 8, BLOCK_SIZE - 8);
+        }
+      }
+    }
+    double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    fprintf(stderr, "%-13s %8.1f ms per GB, %6.2f GB/s (%" PRIx64 ")\n",
+        t < 2 ? type_names[t] : "crc32c 1 chain", ms / gb, gb / ms * 1000, sink);
+  }
+}
+
+//corrupt lb, prev is an earlier version of it
+static void corrupt(log_block_t* lb, const log_block_t& prev, int kind, mt19937_64& rng) {
+  uint8_t* p = (uint8_t*)lb;
+  uint64_t* w = (uint64_t*)lb;
+  //word 0 is the checksum itself
+  uint32_t a = 1 + rng() % (BLOCK_SIZE / 8 - 1);
+  uint32_t b = a;
+  while (b == a) {
+    b = 1 + rng() % (BLOCK_SIZE / 8 - 1);
+  }
+  uint32_t sector = rng() % (BLOCK_SIZE / SECTOR_SIZE);
+  switch (kind) {
+    case 0:
+      p[8 + rng() % (BLOCK_SIZE - 8)] ^= 1 << (rng() % 8);
+      break;
+    case 1: {
+      uint64_t bit = 1ULL << (rng() % 64);
+      w[a] ^= bit;
+      w[b] ^= bit;
+      break;
+    }
+    case 2:
+      //words of entries, the header word holds the checksum type
+      a = 2 + rng() % (BLOCK_SIZE / 8 - 2);
+      b = 2 + rng() % (BLOCK_SIZE / 8 - 2);
+      swap(w[a], w[b]);
+      break;
+    case 3:
+      //the checksum is in sector 0, tear any other one
+      sector = 1 + rng() % (BLOCK_SIZE / SECTOR_SIZE - 1);
+      memcpy(p + sector * SECTOR_SIZE, (uint8_t*)&prev + sector * SECTOR_SIZE, SECTOR_SIZE);
+      break;
+    default:
+      memset(p + sector * SECTOR_SIZE + (sector == 0 ? 8 : 0), 0, SECTOR_SIZE - (sector == 0 ? 8 : 0));
+      break;
+  }
+}
+
+//return whether crc32c detected every corruption
+static bool detection(uint32_t trials) {
+  bool ok = true;
+  const char* kinds[] = {"bit flip", "column flips", "word swap", "torn sector", "zero sector"};
+  fprintf(stderr, "%-13s", "detected");
+  for (const char* name : type_names) {
+    fprintf(stderr, " %12s", name);
+  }
+  fprintf(stderr, "\n");
+  for (int kind = 0; kind < 5; ++kind) {
+    fprintf(stderr, "%-13s", kinds[kind]);
+    for (uint32_t type : types) {
+      mt19937_64 rng(kind + 1);
+      uint32_t detected = 0;
+      uint32_t changed = 0;
+      for (uint32_t i = 0; i < trials; ++i) {
+        //the block grows by a few entries between its two versions
+        log_block_t prev;
+        log_block_t lb;
+        uint32_t n = 1 + rng() % 500;
+        mt19937_64 entries(rng());
+        mt19937_64 same = entries;
+        make_block(&prev, entries, n, type);
+        uint32_t len = make_block(&lb, same, n + 1 + rng() % 20, type);
+        log_block_t good = lb;
+        corrupt(&lb, prev, kind, rng);
+        if (memcmp(&lb, &good, len) == 0) {
+          //equal words swapped, an unchanged sector torn or only bytes past
+          //the entries changed, nothing to detect
+          continue;
+        }
+        changed++;
+        if (!lb.verify()) {
+          detected++;
+        }
+      }
+      if (type == CHECKSUM_CRC32C && detected != changed) {
+        ok = false;
+      }
+      fprintf(stderr, " %5u/%-6u", detected, changed);
+    }
+    fprintf(stderr, "\n");
+  }
+  return ok;
+}
+
+int main(int argc, char** argv) {
+  size_t megabytes = argc > 1 ? strtoul(argv[1], nullptr, 10) : 64;
+  uint32_t trials = argc > 2 ? strtoul(argv[2], nullptr, 10) : 100000;
+  if (megabytes == 0) {
+    megabytes = 64;
+  }
+  bool ok = check_crc32c();
+  throughput(megabytes);
+  if (!detection(trials)) {
+    fprintf(stderr, "crc32c missed a corruption\n");
+    ok = false;
+  }
+  if (!ok) {
+    fprintf(stderr, "FAILED\n");
+  }
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,191 @@
+// Requests per second of the /api/v1 REST API of a running server, with
+// connections threads each sending get_node requests for a few seconds:
+//   close       a new TCP connection per request, Connection: close
+//   keep-alive  one persistent connection per thread, one request at a time
+//   pipelined   one persistent connection per thread, depth requests sent
+//               back to back before reading their responses
+// and the median / 99th percentile latency of a request (of a whole batch
+// when pipelined). Every response must be 200.
+//
+// usage: make http_load_bench
+//        ./http_load_bench host port [seconds] [connections] [depth]
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace std;
+
+typedef chrono::steady_clock bench_clock;
+
+static const char* host;
+static const char* port;
+static double seconds = 3;
+static uint32_t connections = 4;
+static uint32_t depth = 16;
+
+static int connect_server() {
+  struct addrinfo hints;
+  struct addrinfo* res;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, port, &hints, &res) != 0) {
+    return -1;
+  }
+  int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+  if (fd >= 0 and connect(fd, res->ai_addr, res->ai_addrlen) != 0) {
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res);
+  if (fd >= 0) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  }
+  return fd;
+}
+
+static string get_node_request(uint64_t node, bool keep_alive) {
+  string body = "{\"node_id\": " + to_string(node) + "}";
+  return "POST /api/v1/get_node HTTP/1.1\r\nHost: " + string(host) + "\r\n"
+      + (keep_alive ? "" : "Connection: close\r\n")
+      + "Content-Length: " + to_string(body.size()) + "\r\n\r\n" + body;
+}
+
+static bool send_all(int fd, const string& data) {
+  size_t sent = 0;
+  while (sent < data.size()) {
+    ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+    if (n <= 0) {
+      return false;
+    }
+    sent += n;
+  }
+  return true;
+}
+
+//read n responses from fd, buf keeps what follows them. false on a
+//closed connection or a status other than 200
+static bool read_responses(int fd, string& buf, uint32_t n) {
+  char chunk[16384];
+  while (n > 0) {
+    size_t head_end = buf.find("\r\n\r\n");
+    if (head_end != string::npos) {
+      if (buf.compare(0, 12, "HTTP/1.1 200") != 0) {
+        return false;
+      }
+      size_t cl = buf.find("Content-Length: ");
+      if (cl == string::npos or cl > head_end) {
+        return false;
+      }
+      size_t len = head_end + 4 + strtoull(buf.c_str() + cl + 16, nullptr, 10);
+      if (buf.size() >= len) {
+        buf.erase(0, len);
+        n--;
+        continue;
+      }
+    }
+    ssize_t r = recv(fd, chunk, sizeof(chunk), 0);
+    if (r <= 0) {
+      return false;
+    }
+    buf.append(chunk, r);
+  }
+  return true;
+}
+
+static void run(const char* mode, bool keep_alive, uint32_t batch) {
+  atomic<bool> stop(false);
+  atomic<uint64_t> failed(0);
+  vector<uint64_t> requests(connections, 0);
+  vector<vector<double> > latencies(connections);
+  vector<thread> threads;
+  bench_clock::time_point start = bench_clock::now();
+  for (uint32_t t = 0; t < connections; ++t) {
+    threads.emplace_back([&, t]() {
+      int fd = -1;
+      string buf;
+      uint64_t node = t;
+      while (!stop.load()) {
+        if (fd < 0 and (fd = connect_server()) < 0) {
+          failed++;
+          return;
+        }
+        string data;
+        for (uint32_t i = 0; i < batch; ++i) {
+          data += get_node_request(node, keep_alive);
+          node += connections;
+        }
+        bench_clock::time_point begin = bench_clock::now();
+        if (!send_all(fd, data) or !read_responses(fd, buf, batch)) {
+          failed++;
+          close(fd);
+          return;
+        }
+        latencies[t].push_back(chrono::duration<double, micro>(bench_clock::now() - begin).count());
+        requests[t] += batch;
+        if (!keep_alive) {
+          close(fd);
+          fd = -1;
+          buf.clear();
+        }
+      }
+      if (fd >= 0) {
+        close(fd);
+      }
+    });
+  }
+  this_thread::sleep_for(chrono::duration<double>(seconds));
+  stop.store(true);
+  for (thread& th : threads) {
+    th.join();
+  }
+  double ms = chrono::duration<double, milli>(bench_clock::now() - start).count();
+  uint64_t total = 0;
+  vector<double> all;
+  for (uint32_t t = 0; t < connections; ++t) {
+    total += requests[t];
+    all.insert(all.end(), latencies[t].begin(), latencies[t].end());
+  }
+  sort(all.begin(), all.end());
+  double p50 = all.empty() ? 0 : all[all.size() / 2];
+  double p99 = all.empty() ? 0 : all[all.size() * 99 / 100];
+  fprintf(stderr, "%-10s %10.0f requests/s  p50 %8.1f us  p99 %8.1f us  %llu failed\n",
+      mode, total / ms * 1000, p50, p99, (unsigned long long)failed.load());
+}
+
+int main(int argc, char** argv) {
+  if (argc < 3) {
+    fprintf(stderr, "usage: %s host port [seconds] [connections] [depth]\n", argv[0]);
+    return 1;
+  }
+  host = argv[1];
+  port = argv[2];
+  seconds = argc > 3 ? atof(argv[3]) : 3;
+  connections = argc > 4 ? strtoul(argv[4], nullptr, 10) : 4;
+  depth = argc > 5 ? strtoul(argv[5], nullptr, 10) : 16;
+  if (connections == 0) {
+    connections = 1;
+  }
+  if (depth == 0) {
+    depth = 1;
+  }
+  fprintf(stderr, "%u connections, pipeline depth %u\n", connections, depth);
+  run("close", false, 1);
+  run("keep-alive", true, 1);
+  run("pipelined", true, depth);
+  return 0;
+}
@@ -0,0 +1,146 @@
+// Recovery time of a synthetic log: formats a log device, fills the log with
+// valid mutations of a random graph (every entry succeeded when it was
+// logged, as on a real server), then recovers it with increasing numbers of
+// recovery threads and checks every run rebuilt the same graph.
+//
+// Blocks are written straight to the device without a sync per block. When
+// /proc/sys/vm/drop_caches is writable (root) the page cache is dropped
+// before every recovery, so reads come from the disk, otherwise from memory.
+//
+// Node removals are replayed one entry at a time through execute_log_entry,
+// which traces every entry at DEBUG_LEVEL_TRACE: compare a build with
+// make clean && make log_replay_bench DEBUG_LEVEL=0 against the default one
+// for the cost of debug messages, e.g. with 100 removals per mille.
+//
+// usage: make log_replay_bench
+//        ./log_replay_bench devfile [blocks] [vertices] [removals_per_mille] [max_threads]
+// blocks defaults to a full log segment (LOG_SEG_SIZE - 1 blocks, ~2 GB)
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <inttypes.h>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "graph.hpp"
+#include "log.hpp"
+#include "types.hpp"
+
+using namespace std;
+
+static bool drop_caches = false;
+
+//write blocks log blocks of generation generation starting at block 1,
+//return the number of entries
+static uint64_t fill_log(const string& devfile, uint32_t generation, uint32_t blocks,
+    uint64_t vertices, uint32_t removals) {
+  Graph g;
+  mt19937_64 rng(1);
+  int fd = open(devfile.c_str(), O_WRONLY);
+  log_block_t lb;
+  uint64_t entries = 0;
+  for (uint32_t i = 1; i <= blocks; ++i) {
+    lb.clear();
+    lb.generation_num = generation;
+    lb.format = LOG_FORMAT_VARINT;
+    lb.checksum_type = CHECKSUM_CRC32C;
+    log_cursor_t cursor;
+    while (lb.room(cursor) > 0) {
+      uint32_t x = rng() % 1000;
+      uint32_t op = x < 20 ? OP_ADD_NODE : x < 20 + removals ? OP_REMOVE_NODE : x < 850 ? OP_ADD_EDGE : OP_REMOVE_EDGE;
+      uint64_t a = rng() % vertices;
+      uint64_t b = rng() % vertices;
+      auto it = g.g.find(a);
+      if (op == OP_REMOVE_EDGE and it != g.g.end() and !it->second.empty()) {
+        b = *it->second.begin();
+      }
+      if (g.applyOperation(op, a, b) == 200) {
+        lb.append(log_entry_t(op, a, op == OP_ADD_EDGE or op == OP_REMOVE_EDGE ? b : 0), &cursor);
+      }
+    }
+    entries += lb.entry_cnt;
+    lb.checksum = lb.compute_checksum(cursor);
+    if (pwrite(fd, &lb, BLOCK_SIZE, (off_t)i * BLOCK_SIZE) != BLOCK_SIZE) {
+      fprintf(stderr, "write failed at block %u\n", i);
+      exit(1);
+    }
+  }
+  fsync(fd);
+  close(fd);
+  g.dirty.clear();
+  fprintf(stderr, "log: %u blocks, %" PRIu64 " entries, graph: %zu vertices\n",
+      blocks, entries, g.g.size());
+  return entries;
+}
+
+static void drop_page_cache() {
+  if (!drop_caches) {
+    return;
+  }
+  sync();
+  ofstream f("/proc/sys/vm/drop_caches");
+  f << "1" << endl;
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s devfile [blocks] [vertices] [removals_per_mille] [max_threads]\n", argv[0]);
+    return 1;
+  }
+  string devfile = argv[1];
+  uint32_t blocks = argc > 2 ? strtoul(argv[2], nullptr, 10) : LOG_SEG_SIZE - 1;
+  uint64_t vertices = argc > 3 ? strtoull(argv[3], nullptr, 10) : 1000000;
+  uint32_t removals = argc > 4 ? strtoul(argv[4], nullptr, 10) : 0;
+  uint32_t max_threads = argc > 5 ? strtoul(argv[5], nullptr, 10) : thread::hardware_concurrency();
+  drop_caches = access("/proc/sys/vm/drop_caches", W_OK) == 0;
+  if (blocks == 0 or blocks >= LOG_SEG_SIZE) {
+    blocks = LOG_SEG_SIZE - 1;
+  }
+
+  uint32_t generation;
+  {
+    Graph g;
+    server_log slog;
+    slog.bind_graph(&g);
+    slog.set_log_io(LOG_IO_PWRITE);
+    slog.attach_log(devfile);
+    slog.format();
+    super_block_t sb;
+    slog.read_in_superblock(&sb);
+    generation = sb.generation_num;
+  }
+  uint64_t entries = fill_log(devfile, generation, blocks, vertices, removals);
+
+  const char* io_names[] = {"mmap_block", "mmap", "pwrite"};
+  size_t expected_vertices = 0;
+  size_t expected_dirty = 0;
+  for (int io : {LOG_IO_MMAP, LOG_IO_PWRITE}) {
+    for (uint32_t threads = 1; threads <= max_threads; threads *= 2) {
+      drop_page_cache();
+      Graph g;
+      server_log slog;
+      slog.bind_graph(&g);
+      slog.set_log_io(io);
+      slog.set_recovery_threads(threads);
+      slog.attach_log(devfile);
+      chrono::steady_clock::time_point start = chrono::steady_clock::now();
+      slog.init_server_log();
+      double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+      if (expected_vertices == 0) {
+        expected_vertices = g.g.size();
+        expected_dirty = g.dirty.size();
+      }else if (g.g.size() != expected_vertices or g.dirty.size() != expected_dirty) {
+        fprintf(stderr, "recovered graph differs with %u threads\n", threads);
+        return 1;
+      }
+      fprintf(stderr, "%-6s threads %2u: %8.1f ms, %6.1f M entries/s%s\n", io_names[io], threads, ms,
+          entries / ms / 1000, drop_caches ? "" : " (page cache warm)");
+    }
+  }
+  return 0;
+}
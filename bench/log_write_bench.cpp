@@ -0,0 +1,163 @@
+// Append latency and throughput of the log io modes. Formats the log device
+// for every mode, then for a few seconds:
+//   sync    writer threads each append one entry under a write mutex, as
+//           the server does, and wait for it to be durable
+//   async   LOG_IO_DIRECT only: one thread appends without ever waiting, as
+//           the event loop does, and the durable callback tracks when every
+//           entry landed
+// and reports entries per second, the median / 99th percentile time from
+// append to durable and the bytes written to the device per entry.
+// mmap_block is the per-block mmap + msync + munmap baseline the long-lived
+// mapping of mmap replaced. mmap_block, mmap and pwrite always write whole
+// blocks, direct only the sectors that changed when the device takes
+// O_DIRECT writes of SECTOR_SIZE bytes. memory runs the
+// sync writers on STORAGE_MEMORY, the cost of the log without a disk, and
+// segments on STORAGE_SEGMENTS in segment_dir if one is given. Works on a
+// block device or a regular file of at least LOG_SEG_SIZE blocks
+// (truncate -s 3G devfile).
+//
+// usage: make log_write_bench
+//        ./log_write_bench devfile [seconds] [writers] [group_commit_delay_us] [segment_dir]
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "graph.hpp"
+#include "log.hpp"
+#include "types.hpp"
+
+using namespace std;
+
+typedef chrono::steady_clock bench_clock;
+
+static double seconds = 3;
+static uint32_t writers = 4;
+static uint32_t delay_us = 0;
+
+static void report(const char* io, const char* mode, uint64_t entries, double ms, vector<double>& latencies,
+    uint64_t bytes) {
+  sort(latencies.begin(), latencies.end());
+  double p50 = latencies.empty() ? 0 : latencies[latencies.size() / 2];
+  double p99 = latencies.empty() ? 0 : latencies[latencies.size() * 99 / 100];
+  fprintf(stderr, "%-10s %-5s %10.0f entries/s  p50 %8.1f us  p99 %8.1f us  %7.1f bytes/entry\n",
+      io, mode, entries / ms * 1000, p50, p99, entries == 0 ? 0.0 : (double)bytes / entries);
+}
+
+static void open_log(server_log& slog, Graph& g, const string& devfile, int io, int storage) {
+  slog.bind_graph(&g);
+  slog.set_log_io(io);
+  slog.set_storage(storage);
+  slog.attach_log(devfile);
+  slog.set_group_commit_delay(delay_us);
+  slog.format();
+}
+
+static void run_sync(const string& devfile, int io, int storage, const char* name) {
+  Graph g;
+  server_log slog;
+  open_log(slog, g, devfile, io, storage);
+  mutex write_mutex;
+  atomic<bool> stop(false);
+  vector<vector<double> > latencies(writers);
+  vector<thread> threads;
+  uint64_t bytes = slog.get_bytes_written();
+  bench_clock::time_point start = bench_clock::now();
+  for (uint32_t t = 0; t < writers; ++t) {
+    threads.emplace_back([&, t]() {
+      uint64_t node = t;
+      while (!stop.load()) {
+        bench_clock::time_point begin = bench_clock::now();
+        uint64_t lsn;
+        {
+          lock_guard<mutex> wl(write_mutex);
+          lsn = slog.add_log_entry(OP_ADD_NODE, node, 0);
+        }
+        slog.wait_durable(lsn);
+        latencies[t].push_back(chrono::duration<double, micro>(bench_clock::now() - begin).count());
+        node += writers;
+      }
+    });
+  }
+  this_thread::sleep_for(chrono::duration<double>(seconds));
+  stop.store(true);
+  for (thread& th : threads) {
+    th.join();
+  }
+  double ms = chrono::duration<double, milli>(bench_clock::now() - start).count();
+  vector<double> all;
+  for (vector<double>& l : latencies) {
+    all.insert(all.end(), l.begin(), l.end());
+  }
+  report(name, "sync", all.size(), ms, all, slog.get_bytes_written() - bytes);
+}
+
+static void run_async(const string& devfile) {
+  //append time of every entry, lsn i at i - 1. declared before the log,
+  //which stops the reaper running the callback before they go away
+  mutex times_mutex;
+  vector<bench_clock::time_point> appended;
+  vector<double> latencies;
+  uint64_t durable = 0;
+  Graph g;
+  server_log slog;
+  open_log(slog, g, devfile, LOG_IO_DIRECT, STORAGE_DEVICE);
+  slog.set_durable_callback([&]() {
+    uint64_t lsn = slog.get_durable_lsn();
+    bench_clock::time_point now = bench_clock::now();
+    lock_guard<mutex> lk(times_mutex);
+    for (; durable < lsn && durable < appended.size(); ++durable) {
+      latencies.push_back(chrono::duration<double, micro>(now - appended[durable]).count());
+    }
+  });
+  uint64_t bytes = slog.get_bytes_written();
+  bench_clock::time_point start = bench_clock::now();
+  bench_clock::time_point end = start + chrono::duration_cast<bench_clock::duration>(chrono::duration<double>(seconds));
+  uint64_t node = 0;
+  while (bench_clock::now() < end) {
+    {
+      lock_guard<mutex> lk(times_mutex);
+      appended.push_back(bench_clock::now());
+    }
+    slog.add_log_entry(OP_ADD_NODE, node++, 0);
+    if (delay_us > 0 and node % 64 == 0) {
+      slog.start_flush_log();
+    }
+  }
+  slog.flush_log();
+  double ms = chrono::duration<double, milli>(bench_clock::now() - start).count();
+  lock_guard<mutex> lk(times_mutex);
+  report("direct", "async", node, ms, latencies, slog.get_bytes_written() - bytes);
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s devfile [seconds] [writers] [group_commit_delay_us] [segment_dir]\n", argv[0]);
+    return 1;
+  }
+  string devfile = argv[1];
+  seconds = argc > 2 ? atof(argv[2]) : 3;
+  writers = argc > 3 ? strtoul(argv[3], nullptr, 10) : 4;
+  delay_us = argc > 4 ? strtoul(argv[4], nullptr, 10) : 0;
+  if (writers == 0) {
+    writers = 1;
+  }
+  fprintf(stderr, "%u writers, group commit delay %u us\n", writers, delay_us);
+  run_sync(devfile, LOG_IO_MMAP_BLOCK, STORAGE_DEVICE, "mmap_block");
+  run_sync(devfile, LOG_IO_MMAP, STORAGE_DEVICE, "mmap");
+  run_sync(devfile, LOG_IO_PWRITE, STORAGE_DEVICE, "pwrite");
+  run_sync(devfile, LOG_IO_DIRECT, STORAGE_DEVICE, "direct");
+  run_async(devfile);
+  run_sync(devfile, LOG_IO_MMAP, STORAGE_MEMORY, "memory");
+  if (argc > 5) {
+    run_sync(argv[5], LOG_IO_PWRITE, STORAGE_SEGMENTS, "segs");
+  }
+  return 0;
+}
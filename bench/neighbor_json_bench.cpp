@@ -0,0 +1,105 @@
+// Cost of building a get_neighbors response into the send buffer of a
+// connection:
+//   concat   what the server did before append_neighbor_response: to_string
+//            and string concatenation of the json, an ostringstream header
+//            (with the Connection header sent since), header + json and
+//            mg_printf("%s") of the result
+//   append   append_neighbor_response, sized once and formatted in place
+// for vertices of 1, 1K and 1M neighbors. Both must produce the same bytes.
+//
+// usage: make neighbor_json_bench
+//        ./neighbor_json_bench [neighbors_per_degree]
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "utility.hpp"
+
+using namespace std;
+
+typedef chrono::steady_clock bench_clock;
+
+static string concat_http_header(int status_code, string status, size_t content_len) {
+  ostringstream oss;
+  oss << "HTTP/1.1 " << status_code << " " << status << "\r\n";
+  oss << "Connection: keep-alive\r\n";
+  oss << "Content-Length: " << content_len << "\r\n";
+  oss << "Content-Type: application/json\r\n\r\n";
+  return oss.str();
+}
+
+static string concat_neighbor_json(uint64_t node, vector<uint64_t>& nodes) {
+  string json = "\"node_id\": " + to_string(node) + ",";
+  string neighbors;
+  for (int i = 0; i < (int)nodes.size(); ++i) {
+    neighbors.append(to_string(nodes[i]) + ",");
+  }
+  if (!neighbors.empty()) {
+    neighbors.pop_back();
+  }
+  neighbors = "[" + neighbors + "]";
+  json = json + "\"neighbors\": " + neighbors;
+  json = "{" + json + "}";
+  return json;
+}
+
+static void build_concat(struct mg_connection* nc, uint64_t node, vector<uint64_t>& nodes) {
+  string json_result = concat_neighbor_json(node, nodes);
+  string http_header = concat_http_header(200, status_code_mp[200], json_result.size());
+  string http_result = http_header + json_result;
+  mg_printf(nc, "%s", http_result.c_str());
+}
+
+static void build_append(struct mg_connection* nc, uint64_t node, vector<uint64_t>& nodes) {
+  append_neighbor_response(&nc->send_mbuf, node, nodes, nullptr, true);
+}
+
+//ns per response, the send buffer is drained after each one as the event
+//loop would
+template <typename F>
+static double ns_per_response(F build, struct mg_connection* nc, uint64_t node, vector<uint64_t>& nodes,
+    uint64_t iterations) {
+  bench_clock::time_point start = bench_clock::now();
+  for (uint64_t i = 0; i < iterations; ++i) {
+    build(nc, node, nodes);
+    nc->send_mbuf.len = 0;
+  }
+  return chrono::duration<double, nano>(bench_clock::now() - start).count() / iterations;
+}
+
+int main(int argc, char** argv) {
+  uint64_t budget = argc > 1 ? strtoull(argv[1], nullptr, 10) : 10000000;
+  struct mg_connection nc;
+  memset(&nc, 0, sizeof(nc));
+  mbuf_init(&nc.send_mbuf, 0);
+  mt19937_64 rng(426);
+  for (uint64_t degree : {1ULL, 1000ULL, 1000000ULL}) {
+    uint64_t node = rng() % (1ULL << 40);
+    vector<uint64_t> nodes(degree);
+    for (uint64_t& n : nodes) {
+      n = rng() % (1ULL << 40);
+    }
+    build_concat(&nc, node, nodes);
+    string expected(nc.send_mbuf.buf, nc.send_mbuf.len);
+    nc.send_mbuf.len = 0;
+    build_append(&nc, node, nodes);
+    if (expected != string(nc.send_mbuf.buf, nc.send_mbuf.len)) {
+      fprintf(stderr, "%llu neighbors: responses differ\n", (unsigned long long)degree);
+      return 1;
+    }
+    nc.send_mbuf.len = 0;
+    uint64_t iterations = budget / degree > 0 ? budget / degree : 1;
+    double concat = ns_per_response(build_concat, &nc, node, nodes, iterations);
+    double append = ns_per_response(build_append, &nc, node, nodes, iterations);
+    fprintf(stderr, "%8llu neighbors %9zu bytes  concat %12.0f ns  append %12.0f ns  %5.1fx\n",
+        (unsigned long long)degree, expected.size(), concat, append, concat / append);
+  }
+  mbuf_free(&nc.send_mbuf);
+  return 0;
+}
@@ -0,0 +1,92 @@
+// Cost per request of reading the node ids of an /api/v1 request body:
+//   tokens   what the server did before decode_request_ids and still does
+//            for other bodies: copy the body into a string, parse_json2 it
+//            and look up every id with get_node_from_token, as add_edge did
+//            on the head node
+//   decode   decode_request_ids straight from the body
+// for the bodies of a single node request, an edge request and an edge
+// request with extra members and spacing. Both must agree on every body.
+//
+// usage: make request_parse_bench
+//        ./request_parse_bench [iterations]
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include "utility.hpp"
+
+using namespace std;
+
+typedef chrono::steady_clock bench_clock;
+
+//keep the compiler from dropping the work
+static volatile uint64_t sink;
+
+static uint64_t parse_tokens(const char* body, size_t len) {
+  string param_json(body, len);
+  struct json_token* tokens = parse_json2(param_json.c_str(), (int)param_json.size());
+  uint64_t sum = 0;
+  uint64_t a = 0;
+  uint64_t b = 0;
+  if (get_node_from_token(tokens, "node_id", &a)) {
+    sum += a;
+  }else {
+    //add_edge read both ids for the graph, the log and the replication
+    for (int i = 0; i < 3; ++i) {
+      get_node_from_token(tokens, "node_a_id", &a);
+      get_node_from_token(tokens, "node_b_id", &b);
+      sum += a + b;
+    }
+  }
+  free(tokens);
+  return sum;
+}
+
+static uint64_t parse_decode(const char* body, size_t len) {
+  request_ids_t ids;
+  if (!decode_request_ids(body, len, &ids)) {
+    return 0;
+  }
+  return ids.has_node_id ? ids.node_id : 3 * (ids.node_a_id + ids.node_b_id);
+}
+
+template <typename F>
+static double ns_per_request(F parse, const char* body, size_t len, uint64_t iterations) {
+  //read back every time, so the parse of a constant body isn't hoisted
+  const char* volatile request = body;
+  uint64_t sum = 0;
+  bench_clock::time_point start = bench_clock::now();
+  for (uint64_t i = 0; i < iterations; ++i) {
+    sum += parse(request, len);
+  }
+  double ns = chrono::duration<double, nano>(bench_clock::now() - start).count();
+  sink = sum;
+  return ns / iterations;
+}
+
+int main(int argc, char** argv) {
+  uint64_t iterations = argc > 1 ? strtoull(argv[1], nullptr, 10) : 1000000;
+  if (iterations == 0) {
+    iterations = 1;
+  }
+  const char* bodies[][2] = {
+    {"node", "{\"node_id\": 1234567}"},
+    {"edge", "{\"node_a_id\": 1234567, \"node_b_id\": 7654321}"},
+    {"edge+", "{ \"client\": \"load\", \"node_a_id\" : 1234567 ,\n  \"retry\": false, \"node_b_id\": 7654321 }\r\n"},
+  };
+  for (auto& b : bodies) {
+    size_t len = strlen(b[1]);
+    if (parse_tokens(b[1], len) != parse_decode(b[1], len)) {
+      fprintf(stderr, "%s: decoders disagree\n", b[0]);
+      return 1;
+    }
+    double tokens = ns_per_request(parse_tokens, b[1], len, iterations);
+    double decode = ns_per_request(parse_decode, b[1], len, iterations);
+    fprintf(stderr, "%-6s tokens %8.1f ns/request  decode %8.1f ns/request  %6.1fx\n",
+        b[0], tokens, decode, tokens / decode);
+  }
+  return 0;
+}
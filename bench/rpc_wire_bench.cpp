@@ -0,0 +1,129 @@
+// Bytes on the wire and cpu time per replicated op for the v1 string rpcs
+// and the v2 fixed64 messages of graphserverRPC.proto.
+//
+// Counted bytes are the protobuf payload plus the 5 byte grpc message
+// prefix, http/2 frames come on top once per rpc (once per op for v1 and
+// single-op v2, once per bulk for bulk v2). Cpu time covers what the chain
+// does per hop: encode the request, decode it and convert the ids on the
+// replica, encode the reply and decode it on the sender.
+//
+// usage: make rpc_wire_bench && ./rpc_wire_bench [ops] [bulk]
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "graphserverRPC.pb.h"
+#include "types.hpp"
+
+using namespace std;
+using namespace graphserverRPC;
+
+#define GRPC_PREFIX_BYTES 5
+
+struct result_t {
+  double req_bytes;
+  double reply_bytes;
+  double ns;
+};
+
+static uint64_t checksum = 0;
+
+static result_t bench_v1(const vector<uint64_t>& a, const vector<uint64_t>& b) {
+  size_t req_bytes = 0, reply_bytes = 0;
+  string wire, reply_wire;
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  for (size_t i = 0; i < a.size(); ++i) {
+    AddEdgeRequest request;
+    request.set_node_id_a(to_string(a[i]));
+    request.set_node_id_b(to_string(b[i]));
+    request.SerializeToString(&wire);
+    req_bytes += wire.size() + GRPC_PREFIX_BYTES;
+
+    AddEdgeRequest received;
+    received.ParseFromString(wire);
+    checksum += strtoull(received.node_id_a().c_str(), nullptr, 10);
+    checksum += strtoull(received.node_id_b().c_str(), nullptr, 10);
+    RPCReply reply;
+    reply.set_message("Successfully added edge: " + received.node_id_a() + "," + received.node_id_b());
+    reply.SerializeToString(&reply_wire);
+    reply_bytes += reply_wire.size() + GRPC_PREFIX_BYTES;
+
+    RPCReply got;
+    got.ParseFromString(reply_wire);
+    checksum += got.message().size();
+  }
+  double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+  return {(double)req_bytes / a.size(), (double)reply_bytes / a.size(), ns / a.size()};
+}
+
+static result_t bench_v2(const vector<uint64_t>& a, const vector<uint64_t>& b, size_t bulk) {
+  size_t req_bytes = 0, reply_bytes = 0;
+  string wire, reply_wire;
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  for (size_t i = 0; i < a.size(); i += bulk) {
+    size_t n = min(bulk, a.size() - i);
+    OpsV2 request;
+    request.mutable_opcode()->Reserve(n);
+    request.mutable_node_id_a()->Reserve(n);
+    request.mutable_node_id_b()->Reserve(n);
+    for (size_t k = i; k < i + n; ++k) {
+      request.add_opcode(OP_ADD_EDGE);
+      request.add_node_id_a(a[k]);
+      request.add_node_id_b(b[k]);
+    }
+    request.SerializeToString(&wire);
+    req_bytes += wire.size() + GRPC_PREFIX_BYTES;
+
+    OpsV2 received;
+    received.ParseFromString(wire);
+    ReplyV2 reply;
+    reply.set_code(0);
+    reply.mutable_status()->Reserve(n);
+    for (int k = 0; k < received.opcode_size(); ++k) {
+      checksum += received.node_id_a(k) + received.node_id_b(k);
+      reply.add_status(200);
+    }
+    reply.SerializeToString(&reply_wire);
+    reply_bytes += reply_wire.size() + GRPC_PREFIX_BYTES;
+
+    ReplyV2 got;
+    got.ParseFromString(reply_wire);
+    checksum += got.status_size();
+  }
+  double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+  return {(double)req_bytes / a.size(), (double)reply_bytes / a.size(), ns / a.size()};
+}
+
+static void print_result(const char* name, result_t r) {
+  printf("  %-16s %8.1f %8.1f %8.1f %10.1f\n", name, r.req_bytes, r.reply_bytes,
+      r.req_bytes + r.reply_bytes, r.ns);
+}
+
+int main(int argc, char* argv[]) {
+  size_t ops = argc > 1 ? strtoul(argv[1], nullptr, 10) : 1000000;
+  size_t bulk = argc > 2 ? strtoul(argv[2], nullptr, 10) : 64;
+  mt19937_64 rng(426);
+  const char* names[] = {"ids < 10^6", "64-bit ids"};
+  uint64_t limits[] = {1000000, UINT64_MAX};
+  for (int d = 0; d < 2; ++d) {
+    uniform_int_distribution<uint64_t> dist(0, limits[d]);
+    vector<uint64_t> a(ops), b(ops);
+    for (size_t i = 0; i < ops; ++i) {
+      a[i] = dist(rng);
+      b[i] = dist(rng);
+    }
+    printf("%zu add_edge ops, %s\n", ops, names[d]);
+    printf("  %-16s %8s %8s %8s %10s\n", "", "req B", "reply B", "total B", "cpu ns/op");
+    print_result("v1 string", bench_v1(a, b));
+    print_result("v2 single op", bench_v2(a, b, 1));
+    string bulk_name = "v2 bulk " + to_string(bulk);
+    print_result(bulk_name.c_str(), bench_v2(a, b, bulk));
+  }
+  //keep the decoded values alive
+  return checksum == 42 ? 1 : 0;
+}
@@ -0,0 +1,126 @@
+#include "checksum.hpp"
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#define CRC32C_X86 1
+#else
+#define CRC32C_X86 0
+#endif
+
+//reflected Castagnoli polynomial
+#define CRC32C_POLY 0x82f63b78
+
+//the crc register is kept inverted between the update functions
+
+static inline uint64_t load64(const uint8_t* p) {
+  uint64_t w;
+  memcpy(&w, p, sizeof(w));
+  return w;
+}
+
+//slicing by 8: table[k][b] is the crc of byte b followed by k zero bytes
+struct crc32c_tables {
+  uint32_t table[8][256];
+
+  crc32c_tables() {
+    for (uint32_t b = 0; b < 256; ++b) {
+      uint32_t c = b;
+      for (int k = 0; k < 8; ++k) {
+        c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+      }
+      table[0][b] = c;
+    }
+    for (uint32_t b = 0; b < 256; ++b) {
+      for (int k = 1; k < 8; ++k) {
+        table[k][b] = (table[k - 1][b] >> 8) ^ table[0][table[k - 1][b] & 0xff];
+      }
+    }
+  }
+};
+
+static const crc32c_tables tables;
+
+static uint32_t update_sw(uint32_t crc, const uint8_t* p, size_t len) {
+  const uint32_t (*t)[256] = tables.table;
+  for (; len >= 8; p += 8, len -= 8) {
+    uint64_t w = load64(p) ^ crc;
+    crc = t[7][w & 0xff] ^ t[6][(w >> 8) & 0xff] ^ t[5][(w >> 16) & 0xff] ^ t[4][(w >> 24) & 0xff]
+        ^ t[3][(w >> 32) & 0xff] ^ t[2][(w >> 40) & 0xff] ^ t[1][(w >> 48) & 0xff] ^ t[0][w >> 56];
+  }
+  for (; len > 0; ++p, --len) {
+    crc = (crc >> 8) ^ t[0][(crc ^ *p) & 0xff];
+  }
+  return crc;
+}
+
+#if CRC32C_X86
+__attribute__((target("sse4.2")))
+static uint32_t update_hw(uint32_t crc, const uint8_t* p, size_t len) {
+  uint64_t c = crc;
+  for (; len >= 8; p += 8, len -= 8) {
+    c = _mm_crc32_u64(c, load64(p));
+  }
+  for (; len > 0; ++p, --len) {
+    c = _mm_crc32_u8((uint32_t)c, *p);
+  }
+  return (uint32_t)c;
+}
+
+__attribute__((target("sse4.2")))
+static uint64_t halves_hw(const uint8_t* p, size_t len) {
+  size_t half = len / 2;
+  const uint8_t* q = p + half;
+  uint64_t a = 0xffffffff;
+  uint64_t b = 0xffffffff;
+  size_t i = 0;
+  for (; i + 8 <= half; i += 8) {
+    a = _mm_crc32_u64(a, load64(p + i));
+    b = _mm_crc32_u64(b, load64(q + i));
+  }
+  a = update_hw((uint32_t)a, p + i, half - i);
+  b = update_hw((uint32_t)b, q + i, len - half - i);
+  return (uint64_t)~(uint32_t)a << 32 | ~(uint32_t)b;
+}
+
+static bool has_sse42() {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("sse4.2");
+}
+
+static const bool use_hw = has_sse42();
+#else
+static const bool use_hw = false;
+#endif
+
+uint32_t crc32c(uint32_t crc, const void* data, size_t len) {
+  const uint8_t* p = (const uint8_t*)data;
+#if CRC32C_X86
+  if (use_hw) {
+    return ~update_hw(~crc, p, len);
+  }
+#endif
+  return ~update_sw(~crc, p, len);
+}
+
+uint64_t crc32c_halves(const void* data, size_t len) {
+  const uint8_t* p = (const uint8_t*)data;
+#if CRC32C_X86
+  if (use_hw) {
+    return halves_hw(p, len);
+  }
+#endif
+  size_t half = len / 2;
+  return (uint64_t)crc32c(0, p, half) << 32 | crc32c(0, p + half, len - half);
+}
+
+bool crc32c_hardware() {
+  return use_hw;
+}
+
+uint32_t crc32c_sw(uint32_t crc, const void* data, size_t len) {
+  return ~update_sw(~crc, (const uint8_t*)data, len);
+}
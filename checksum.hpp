@@ -0,0 +1,24 @@
+#ifndef _CHECKSUM_H
+#define _CHECKSUM_H
+
+#include <cstdint>
+#include <cstddef>
+
+//crc32c (Castagnoli) of len bytes, continuing from the crc of the bytes
+//before them. uses the SSE4.2 crc32 instruction when the cpu has it and
+//sliced lookup tables otherwise
+uint32_t crc32c(uint32_t crc, const void* data, size_t len);
+
+//crc32c of the first half of len bytes in the high 32 bits and of the
+//second half in the low 32 bits, the two run interleaved to overlap the
+//latency of the crc32 instruction
+uint64_t crc32c_halves(const void* data, size_t len);
+
+//whether crc32c runs on the crc32 instruction
+bool crc32c_hardware();
+
+//crc32c on the lookup tables whatever the cpu has, to check the paths
+//against each other
+uint32_t crc32c_sw(uint32_t crc, const void* data, size_t len);
+
+#endif
@@ -6,12 +6,22 @@
 #include <unordered_map>
 #include <cstdint>
 #include <thread>
+#include <deque>
+#include <chrono>
+#include <mutex>
+#include <memory>
+#include <atomic>
+#include <unordered_set>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <grpc++/grpc++.h>
 #include "mongoose.h"
 #include "graph.hpp"
 #include "utility.hpp"
 #include "log.hpp"
 #include "types.hpp"
+#include "debug.hpp"
+#include "worker_pool.hpp"
 #include "rpcsender_client.cc"
 #include "rpcsender_server.cc"
 
@@ -25,11 +35,67 @@ using namespace std;
 static struct mg_serve_http_opts s_http_server_opts;
 static int s_sig_num = 0;
 static const struct mg_str s_post_method = MG_STR("POST");
+static const struct mg_str s_api_prefix = MG_STR("/api/v1");
 
 static struct Graph graph;
 static server_log slog;
 static rpcsenderClient* grpc_client = nullptr;
+//set when mutations are streamed down the chain instead of one rpc each
+static chainReplicator* replicator = nullptr;
 static rpcsenderServiceImpl rpc_service;
+static rpcsenderV2ServiceImpl rpc_service_v2(&rpc_service);
+
+static struct mg_mgr mgr;
+
+//write checkpoints from a snapshot in the background instead of blocking
+static bool background_checkpoint = true;
+
+//number of threads executing /api/v1 requests, 0 runs them in the event loop
+static int http_workers = 0;
+static worker_pool* workers = nullptr;
+//serializes replication, apply and logging of mutations so the log and the
+//downstream replicas see them in the same order
+static mutex write_mutex;
+
+//responses held back until their request is executed by a worker, the
+//log entry they depend on is durable and the rest of the chain acked it
+struct pending_response {
+  struct mg_connection* nc;
+  struct mbuf http_result;
+  uint64_t lsn = 0;
+  uint64_t seq = 0;
+  chrono::steady_clock::time_point queued;
+  atomic<bool> done;
+  //a get_neighbors stream of ids to start instead of sending http_result
+  bool stream = false;
+  request_ids_t ids;
+  //false closes the connection once the response is sent
+  bool keep_alive = true;
+  //the request body a worker runs the request from, mongoose drops hm
+  //once the event handler returns
+  string body;
+
+  pending_response(struct mg_connection* c) : nc(c), done(false) {
+    mbuf_init(&http_result, 0);
+  }
+
+  ~pending_response() {
+    mbuf_free(&http_result);
+  }
+};
+static deque<shared_ptr<pending_response> > pending_responses;
+
+//get_neighbors responses being streamed, neighbors from cursor on are
+//still to be sent. page is reused for every chunk
+struct neighbor_stream {
+  uint64_t node_id;
+  uint64_t cursor;
+  bool started = false;
+  bool first = true;
+  bool keep_alive = true;
+  vector<uint64_t> page;
+};
+static unordered_map<struct mg_connection*, neighbor_stream> neighbor_streams;
 
 void RunRPCServer(string server_address) {
   ServerBuilder builder;
@@ -38,9 +104,10 @@ void RunRPCServer(string server_address) {
   // Register "rpc_service" as the instance through which we'll communicate with
   // clients. In this case it corresponds to an *synchronous* rpc_service.
   builder.RegisterService(&rpc_service);
+  builder.RegisterService(&rpc_service_v2);
   // Finally assemble the server.
   std::unique_ptr<Server> server(builder.BuildAndStart());
-  std::cout << "Server listening on " << server_address << std::endl;
+  debug_info("Server listening on %s.", server_address.c_str());
   // Wait for the server to shutdown. Note that some other thread must be
   // responsible for shutting down the server for this call to ever return.
   server->Wait();
@@ -59,195 +126,563 @@ static int is_equal(const struct mg_str *s1, const struct mg_str *s2) {
   return s1->len == s2->len && memcmp(s1->p, s2->p, s2->len) == 0;
 }
 
+static bool has_pending_response(struct mg_connection* nc) {
+  if (neighbor_streams.count(nc) > 0) {
+    return true;
+  }
+  for (auto& p : pending_responses) {
+    if (p->nc == nc) {
+      return true;
+    }
+  }
+  return false;
+}
+
+//1 if the rest of the chain acked seq, -1 if it was lost, 0 if in flight
+static int replication_state(uint64_t seq) {
+  return replicator == nullptr ? 1 : replicator->State(seq);
+}
+
+//1 if log entry lsn is durable, -1 if a failed log write keeps it from ever
+//getting there, 0 if it is still being written
+static int log_state(uint64_t lsn, uint64_t durable) {
+  if (lsn <= durable) {
+    return 1;
+  }
+  return slog.get_write_error() != 0 ? -1 : 0;
+}
+
+//the last response of a connection that doesn't stay open is in its send
+//buffer, close it once that is sent
+static void end_response(struct mg_connection* nc, bool keep_alive) {
+  if (!keep_alive) {
+    nc->flags |= MG_F_SEND_AND_CLOSE;
+  }
+}
+
+//the response built at offset off of the send buffer goes out now if its
+//log entry is durable and replicated, otherwise it is moved out of the send
+//buffer and queued. the connection has no pending response
+static void send_response(struct mg_connection* nc, size_t off, uint64_t lsn, uint64_t seq, bool keep_alive) {
+  struct mbuf* out = &nc->send_mbuf;
+  int logged = log_state(lsn, slog.get_durable_lsn());
+  int replicated = replication_state(seq);
+  if (logged >= 0 and replicated >= 0 and (logged == 0 or replicated == 0)) {
+    shared_ptr<pending_response> p = make_shared<pending_response>(nc);
+    mbuf_append(&p->http_result, out->buf + off, out->len - off);
+    out->len = off;
+    p->lsn = lsn;
+    p->seq = seq;
+    p->keep_alive = keep_alive;
+    p->queued = chrono::steady_clock::now();
+    p->done.store(true);
+    pending_responses.push_back(p);
+    return;
+  }
+  if (logged < 0 or replicated < 0) {
+    out->len = off;
+    append_result_http_header(out, 500, status_code_mp[500], 0, keep_alive);
+  }
+  end_response(nc, keep_alive);
+}
+
+//send the next chunks of the get_neighbors stream of nc while its send
+//buffer is low, the rest once mongoose sent it. the first chunk starts the
+//response, 400 if the node doesn't exist
+static void pump_neighbor_stream(struct mg_connection* nc) {
+  auto it = neighbor_streams.find(nc);
+  if (it == neighbor_streams.end()) {
+    return;
+  }
+  neighbor_stream& st = it->second;
+  struct mbuf* out = &nc->send_mbuf;
+  while (out->len < NEIGHBOR_STREAM_LOW_WATER) {
+    pair<int, bool> status;
+    {
+      graph_read_guard rg(&graph);
+      status = graph.getNeighborPage(st.node_id, st.cursor, NEIGHBOR_STREAM_CHUNK, st.page);
+    }
+    if (!st.started) {
+      if (status.first != 200) {
+        append_result_http_header(out, status.first, status_code_mp[status.first], 0, st.keep_alive);
+        end_response(nc, st.keep_alive);
+        neighbor_streams.erase(it);
+        return;
+      }
+      char head[40];
+      memcpy(head, "{\"node_id\": ", 12);
+      char* p = format_uint64(head + 12, st.node_id);
+      memcpy(p, ",\"neighbors\": [", 15);
+      append_chunked_http_header(out, 200, status_code_mp[200], st.keep_alive);
+      mg_send_http_chunk(nc, head, p + 15 - head);
+      st.started = true;
+    }
+    //a node removed in the middle of the stream ends its list
+    append_neighbor_chunk(out, st.page, st.first);
+    if (!st.page.empty()) {
+      st.first = false;
+      st.cursor = st.page.back() + 1;
+    }
+    if (!status.second) {
+      mg_send_http_chunk(nc, "]}", 2);
+      mg_send_http_chunk(nc, "", 0);
+      end_response(nc, st.keep_alive);
+      neighbor_streams.erase(it);
+      return;
+    }
+  }
+}
+
+static void start_neighbor_stream(struct mg_connection* nc, const request_ids_t& ids, bool keep_alive) {
+  neighbor_stream& st = neighbor_streams[nc];
+  st.node_id = ids.node_id;
+  st.cursor = ids.has_cursor ? ids.cursor : 0;
+  st.keep_alive = keep_alive;
+  pump_neighbor_stream(nc);
+}
+
+//send every response that is done, durable and replicated, unless an earlier
+//response of the same connection is still pending. group commit: once a done response has
+//waited for the max batch delay, make the whole batch durable with one write.
+//LOG_IO_DIRECT only starts the write, its completion wakes up the event loop
+static void release_pending_responses() {
+  if (pending_responses.empty()) {
+    return;
+  }
+  chrono::microseconds delay(slog.get_group_commit_delay());
+  chrono::steady_clock::time_point now = chrono::steady_clock::now();
+  uint64_t durable = slog.get_durable_lsn();
+  for (auto& p : pending_responses) {
+    if (p->done.load() and p->lsn > durable and now - p->queued >= delay) {
+      slog.start_flush_log();
+      durable = slog.get_durable_lsn();
+      break;
+    }
+  }
+  unordered_set<struct mg_connection*> blocked;
+  for (auto it = pending_responses.begin(); it != pending_responses.end();) {
+    shared_ptr<pending_response> p = *it;
+    bool done = p->done.load();
+    int logged = done ? log_state(p->lsn, durable) : 0;
+    int replicated = done ? replication_state(p->seq) : 0;
+    if (blocked.count(p->nc) == 0 and neighbor_streams.count(p->nc) == 0 and done
+        and (logged < 0 or replicated < 0 or (logged > 0 and replicated > 0))) {
+      if (p->stream) {
+        start_neighbor_stream(p->nc, p->ids, p->keep_alive);
+        it = pending_responses.erase(it);
+        continue;
+      }
+      if (logged < 0 or replicated < 0) {
+        //applied here but not durable, or the rest of the chain gets it
+        //once the stream is back
+        p->http_result.len = 0;
+        append_result_http_header(&p->http_result, 500, status_code_mp[500], 0, p->keep_alive);
+      }
+      mg_send(p->nc, p->http_result.buf, (int)p->http_result.len);
+      end_response(p->nc, p->keep_alive);
+      it = pending_responses.erase(it);
+    }else {
+      blocked.insert(p->nc);
+      ++it;
+    }
+  }
+}
+
+static void drop_pending_responses(struct mg_connection* nc) {
+  for (auto it = pending_responses.begin(); it != pending_responses.end();) {
+    if ((*it)->nc == nc) {
+      it = pending_responses.erase(it);
+    }else {
+      ++it;
+    }
+  }
+}
+
+//mg_broadcast callback, only used to wake up mg_mgr_poll
+static void wakeup_handler(struct mg_connection *nc, int ev, void *ev_data) {
+}
+
+//apply add_node/add_edge/remove_node/remove_edge on the whole chain.
+//synchronous replication waits for the rest of the chain before applying
+//locally, pipelined replication applies first and streams the logged entry
+//downstream, the response then waits for its ack. if the stream breaks
+//before the ack the response is a 500, the entry stays applied here and the
+//replicator resends it once it reopened the stream
+static void handle_mutation(uint32_t opcode, uint64_t node_a, uint64_t node_b, const struct mg_str& body,
+    int& status_code, string& json_result, uint64_t* lsn, uint64_t* seq) {
+  lock_guard<mutex> wl(write_mutex);
+  if (!slog.reserve_log(1)) {
+    json_result = "";
+    status_code = 507;
+    return;
+  }
+  if (replicator == nullptr and grpc_client != nullptr and
+      !grpc_client->Forward(vector<log_entry_t>(1, log_entry_t(opcode, node_a, node_b)))) {
+    json_result = "";
+    status_code = 500;
+    return;
+  }
+  {
+    graph_write_guard wg(&graph);
+    status_code = graph.applyOperation(opcode, node_a, node_b);
+    if (status_code == 200) {
+      *lsn = slog.add_log_entry(opcode, node_a, node_b);
+    }
+  }
+  if (replicator != nullptr and status_code == 200) {
+    *seq = replicator->Send(vector<log_entry_t>(1, log_entry_t(opcode, node_a, node_b)));
+  }
+  //the response echoes the request
+  json_result = status_code == 200 ? string(body.p, body.len) : "";
+}
+
+//parse one operation object of a batch request,
+//return false if the op name or a node id is missing
+static bool parse_batch_operation(struct json_token* op, log_entry_t* entry) {
+  struct json_token* name = find_json_token(op, "op");
+  if (name == nullptr) {
+    return false;
+  }
+  string opname(name->ptr, name->len);
+  const char* key_a = "node_a_id";
+  const char* key_b = "node_b_id";
+  if (opname == "add_node") {
+    entry->opcode = OP_ADD_NODE;
+    key_a = "node_id";
+    key_b = nullptr;
+  }else if (opname == "add_edge") {
+    entry->opcode = OP_ADD_EDGE;
+  }else if (opname == "remove_node") {
+    entry->opcode = OP_REMOVE_NODE;
+    key_a = "node_id";
+    key_b = nullptr;
+  }else if (opname == "remove_edge") {
+    entry->opcode = OP_REMOVE_EDGE;
+  }else {
+    return false;
+  }
+  entry->node2 = 0;
+  return get_node_from_token(op, key_a, &entry->node1)
+      and (key_b == nullptr or get_node_from_token(op, key_b, &entry->node2));
+}
+
+//apply {"operations": [{"op": "add_node", "node_id": 1}, ...]} in order.
+//malformed operations get 400 and are skipped, the rest is replicated as
+//one rpc and logged together
+static void handle_batch_request(struct json_token* tokens, int& status_code, string& json_result,
+    uint64_t* lsn, uint64_t* seq) {
+  struct json_token* arr = tokens == nullptr ? nullptr : find_json_token(tokens, "operations");
+  if (arr == nullptr or arr->type != JSON_TYPE_ARRAY) {
+    json_result = "";
+    status_code = 400;
+    return;
+  }
+  vector<log_entry_t> ops;
+  vector<bool> valid;
+  struct json_token* end = arr + 1 + arr->num_desc;
+  for (struct json_token* op = arr + 1; op < end; op += 1 + op->num_desc) {
+    log_entry_t entry;
+    valid.push_back(op->type == JSON_TYPE_OBJECT and parse_batch_operation(op, &entry));
+    if (valid.back()) {
+      ops.push_back(entry);
+    }
+  }
+  lock_guard<mutex> wl(write_mutex);
+  if (!slog.reserve_log(ops.size())) {
+    json_result = "";
+    status_code = 507;
+    return;
+  }
+  if (replicator == nullptr and grpc_client != nullptr and !ops.empty() and !grpc_client->Forward(ops)) {
+    json_result = "";
+    status_code = 500;
+    return;
+  }
+  vector<int> status_codes;
+  vector<log_entry_t> applied;
+  {
+    graph_write_guard wg(&graph);
+    size_t k = 0;
+    for (size_t i = 0; i < valid.size(); ++i) {
+      if (!valid[i]) {
+        status_codes.push_back(400);
+        continue;
+      }
+      log_entry_t& op = ops[k++];
+      int op_status = graph.applyOperation(op.opcode, op.node1, op.node2);
+      status_codes.push_back(op_status);
+      if (op_status == 200) {
+        applied.push_back(op);
+      }
+    }
+    if (!applied.empty()) {
+      *lsn = slog.add_log_entries(applied);
+    }
+  }
+  if (replicator != nullptr and !applied.empty()) {
+    *seq = replicator->Send(applied);
+  }
+  json_result = gen_batch_json_result(status_codes);
+  status_code = 200;
+}
+
+//execute one /api/v1 request and append the http response to out, lsn and
+//seq are set to the log entry and the replication sequence number the
+//response has to wait for (0 if none). decoded tells whether ids already
+//holds the node ids of body, read by decode_request_ids
+static void handle_api_request(const string& request, const struct mg_str& body, bool decoded,
+    request_ids_t ids, bool keep_alive, struct mbuf* out, uint64_t* lsn, uint64_t* seq) {
+  struct json_token* tokens = nullptr;
+  int status_code = 200;
+  string json_result;
+  if (!decoded or request == "batch") {
+    tokens = parse_json2(body.p, (int)body.len);
+    if (!decoded) {
+      get_ids_from_tokens(tokens, &ids);
+    }
+  }
+  bool one_node = request == "add_node" or request == "remove_node" or request == "get_node"
+      or request == "get_neighbors";
+  bool two_nodes = request == "add_edge" or request == "remove_edge" or request == "get_edge"
+      or request == "shortest_path";
+  if ((one_node and !ids.has_node_id) or (two_nodes and (!ids.has_node_a_id or !ids.has_node_b_id))) {
+    free(tokens);
+    append_result_http_header(out, 400, status_code_mp[400], 0, keep_alive);
+    return;
+  }
+
+  if (request == "add_node") {
+    handle_mutation(OP_ADD_NODE, ids.node_id, 0,
+        body, status_code, json_result, lsn, seq);
+  }else if (request == "add_edge") {
+    handle_mutation(OP_ADD_EDGE, ids.node_a_id, ids.node_b_id,
+        body, status_code, json_result, lsn, seq);
+  }else if (request == "remove_node") {
+    handle_mutation(OP_REMOVE_NODE, ids.node_id, 0,
+        body, status_code, json_result, lsn, seq);
+  }else if (request == "remove_edge") {
+    handle_mutation(OP_REMOVE_EDGE, ids.node_a_id, ids.node_b_id,
+        body, status_code, json_result, lsn, seq);
+  }else if (request == "get_node") {
+    graph_read_guard rg(&graph);
+    pair<int, int> status = graph.getNode(ids.node_id);
+    char buf[1000];
+    if (status.second == 1) {
+      json_emit(buf, sizeof(buf), "{ s: T }", "in_graph");
+    }else {
+      json_emit(buf, sizeof(buf), "{ s: F }", "in_graph");
+    }
+    json_result = string(buf);
+    status_code = status.first;
+  }else if (request == "get_edge") {
+    graph_read_guard rg(&graph);
+    pair<int, int> status = graph.getEdge(ids.node_a_id, ids.node_b_id);
+    char buf[1000];
+    if (status.first == 200) {
+      if (status.second == 1) {
+        json_emit(buf, sizeof(buf), "{ s: T }", "in_graph");
+      }else {
+        json_emit(buf, sizeof(buf), "{ s: F }", "in_graph");
+      }
+      json_result = string(buf);
+    }else {
+      json_result = "";
+    }
+    status_code = status.first;
+  }else if (request == "get_neighbors" and ids.has_cursor and !ids.valid_cursor) {
+    //not a cursor of a page of this node
+    json_result = "";
+    status_code = 400;
+  }else if (request == "get_neighbors" and ids.has_limit) {
+    //one page of at most limit neighbors from the cursor on, next_cursor
+    //continues it
+    graph_read_guard rg(&graph);
+    vector<uint64_t> page;
+    pair<int, bool> status = graph.getNeighborPage(ids.node_id, ids.has_cursor ? ids.cursor : 0, ids.limit, page);
+    if (status.first == 200 and ids.limit > 0) {
+      uint64_t next_cursor = status.second ? page.back() + 1 : 0;
+      append_neighbor_response(out, ids.node_id, page, status.second ? &next_cursor : nullptr, keep_alive);
+      free(tokens);
+      return;
+    }
+    json_result = "";
+    status_code = 400;
+  }else if (request == "get_neighbors") {
+    graph_read_guard rg(&graph);
+    pair<int, vector<uint64_t>> status = graph.getNeighbors(ids.node_id);
+    if (status.first == 200) {
+      //formatted straight into out, it can be megabytes
+      append_neighbor_response(out, ids.node_id, status.second, nullptr, keep_alive);
+      free(tokens);
+      return;
+    }
+    json_result = "";
+    status_code = status.first;
+  }else if (request == "shortest_path") {
+    graph_read_guard rg(&graph);
+    pair<int, int> status = graph.shortestPath(ids.node_a_id, ids.node_b_id);
+    char buf[1000];
+    if (status.first == 200) {
+      json_emit(buf, sizeof(buf), "{ s: i }", "distance", status.second);
+      json_result = string(buf);
+    }else {
+      json_result = "";
+    }
+    status_code = status.first;
+  }else if (request == "batch") {
+    handle_batch_request(tokens, status_code, json_result, lsn, seq);
+  }else if (request == "checkpoint") {
+    //a checkpoint truncates the log, so it can be taken while the log is
+    //full, but not without room for the new image next to the current one
+    lock_guard<mutex> wl(write_mutex);
+    bool ok;
+    if (background_checkpoint) {
+      //returns once the snapshot is taken, a request while a checkpoint
+      //is running is a no-op
+      ok = slog.start_checkpoint();
+    }else {
+      ok = slog.checkpoint();
+    }
+    json_result = "";
+    status_code = ok ? 200 : 507;
+  }
+  free(tokens);
+  append_result_http_header(out, status_code, status_code_mp[status_code], json_result.size(), keep_alive);
+  mbuf_append(out, json_result.data(), json_result.size());
+}
+
+//run one POST /api/v1 request, return false if the connection doesn't stay
+//open after it
+static bool handle_http_request(struct mg_connection* nc, struct http_message* hm) {
+  string request = get_command_type_from_uri(hm->uri);
+  bool keep_alive = http_keep_alive(hm);
+  request_ids_t ids;
+  bool decoded = decode_request_ids(hm->body.p, hm->body.len, &ids);
+  if (request == "get_neighbors" and !decoded) {
+    struct json_token* tokens = parse_json2(hm->body.p, (int)hm->body.len);
+    get_ids_from_tokens(tokens, &ids);
+    free(tokens);
+    decoded = true;
+  }
+  if (request == "get_neighbors" and ids.has_cursor) {
+    //the token points into the body, a bad cursor gets a 400 below
+    decode_neighbor_cursor(&ids);
+    ids.cursor_token.p = nullptr;
+    ids.cursor_token.len = 0;
+  }
+  if (request == "get_neighbors" and ids.stream and ids.has_node_id and (!ids.has_cursor or ids.valid_cursor)) {
+    //streamed from the event loop, after the earlier responses of
+    //the connection
+    if (!has_pending_response(nc)) {
+      start_neighbor_stream(nc, ids, keep_alive);
+    }else {
+      shared_ptr<pending_response> p = make_shared<pending_response>(nc);
+      p->stream = true;
+      p->ids = ids;
+      p->keep_alive = keep_alive;
+      p->queued = chrono::steady_clock::now();
+      p->done.store(true);
+      pending_responses.push_back(p);
+    }
+  }else if (http_workers == 0 and !has_pending_response(nc)) {
+    //build the response right in the send buffer of the connection,
+    //send_response takes it back out if it has to wait
+    uint64_t lsn = 0;
+    uint64_t seq = 0;
+    size_t off = nc->send_mbuf.len;
+    handle_api_request(request, hm->body, decoded, ids, keep_alive, &nc->send_mbuf, &lsn, &seq);
+    send_response(nc, off, lsn, seq, keep_alive);
+  }else if (http_workers == 0) {
+    //behind a pending response of the connection
+    shared_ptr<pending_response> p = make_shared<pending_response>(nc);
+    handle_api_request(request, hm->body, decoded, ids, keep_alive, &p->http_result, &p->lsn, &p->seq);
+    p->keep_alive = keep_alive;
+    p->queued = chrono::steady_clock::now();
+    p->done.store(true);
+    pending_responses.push_back(p);
+  }else {
+    //run the request on a worker, the response is sent in request
+    //order by release_pending_responses once it is done
+    shared_ptr<pending_response> p = make_shared<pending_response>(nc);
+    p->keep_alive = keep_alive;
+    p->body.assign(hm->body.p, hm->body.len);
+    pending_responses.push_back(p);
+    workers->submit([p, request, decoded, ids, keep_alive]() {
+      struct mg_str body = {p->body.data(), p->body.size()};
+      handle_api_request(request, body, decoded, ids, keep_alive, &p->http_result, &p->lsn, &p->seq);
+      p->queued = chrono::steady_clock::now();
+      p->done.store(true);
+      //wake up the event loop
+      mg_broadcast(&mgr, wakeup_handler, (void*)"w", 1);
+    });
+  }
+  return keep_alive;
+}
+
+//mongoose hands over one request per read and leaves the rest of the
+//receive buffer until more data arrives. run the complete api requests
+//pipelined behind hm right away and drop them from the buffer, mongoose
+//drops hm itself. anything else is left to mongoose
+static void handle_pipelined_requests(struct mg_connection* nc, struct http_message* hm) {
+  struct mbuf* io = &nc->recv_mbuf;
+  size_t first = hm->message.p + hm->message.len - io->buf;
+  size_t done = first;
+  while (done < io->len) {
+    struct http_message next;
+    int req_len = mg_parse_http(io->buf + done, io->len - done, &next, 1);
+    if (req_len <= 0 or next.message.len > io->len - done or !has_prefix(&next.uri, &s_api_prefix)
+        or !is_equal(&next.method, &s_post_method) or mg_get_http_header(&next, "Transfer-Encoding") != nullptr) {
+      break;
+    }
+    done += next.message.len;
+    if (!handle_http_request(nc, &next)) {
+      break;
+    }
+  }
+  if (done > first) {
+    memmove(io->buf + first, io->buf + done, io->len - done);
+    io->len -= done - first;
+  }
+}
+
 static void ev_handler(struct mg_connection *nc, int ev, void *ev_data) {
-  static const struct mg_str api_prefix = MG_STR("/api/v1");
   struct http_message *hm = (struct http_message *) ev_data;
-  struct json_token* tokens;
-  string http_header;
-  string json_result;
-  string http_result;
   switch (ev) {
+    case MG_EV_RECV:
+      //responses of a persistent connection go out in several writes, don't
+      //let the later ones wait for the ack of the first. the socket isn't
+      //set yet on MG_EV_ACCEPT, MG_F_USER_1 marks it done
+      if (!(nc->flags & MG_F_USER_1)) {
+        int one = 1;
+        setsockopt(nc->sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        nc->flags |= MG_F_USER_1;
+      }
+      break;
     case MG_EV_HTTP_REQUEST:
-      if (has_prefix(&hm->uri, &api_prefix)) {
+      if (has_prefix(&hm->uri, &s_api_prefix)) {
         if (is_equal(&hm->method, &s_post_method)){
-          string request = get_command_type_from_uri(hm->uri.p);
-          string param_json(hm->body.p, hm->body.len);
-          tokens = parse_json2(param_json.c_str(), (int)param_json.size());
-
-          if (request == "add_node") {
-            if (slog.log_is_full()) {
-              json_result = "";
-              http_header = gen_result_http_header(507, status_code_mp[507], 0);
-            }else {
-              if (grpc_client != nullptr) {
-                string reply = grpc_client->SendAddNode(to_string(get_node_from_token(tokens, "node_id")));
-                if (reply == "RPC failed") {
-                  json_result = "";
-                  http_header = gen_result_http_header(500, status_code_mp[500], 0);
-                }else {
-                  int status_code = graph.addNode(get_node_from_token(tokens, "node_id"));
-                  json_result = status_code == 200 ? param_json : "";
-                  http_header = gen_result_http_header(status_code, status_code_mp[status_code], json_result.size());
-                  if (status_code == 200) {
-                    slog.add_log_entry(OP_ADD_NODE, get_node_from_token(tokens, "node_id"), 0);
-                  }
-                }
-              }else {
-                //only primary node in the chain
-                int status_code = graph.addNode(get_node_from_token(tokens, "node_id"));
-                json_result = status_code == 200 ? param_json : "";
-                http_header = gen_result_http_header(status_code, status_code_mp[status_code], json_result.size());
-                if (status_code == 200) {
-                  slog.add_log_entry(OP_ADD_NODE, get_node_from_token(tokens, "node_id"), 0);
-                }
-              }
-            }
-          }else if (request == "add_edge") {
-            if (slog.log_is_full()) {
-              json_result = "";
-              http_header = gen_result_http_header(507, status_code_mp[507], 0);
-            }else {
-              if (grpc_client != nullptr) {
-                string reply = grpc_client->SendAddEdge(to_string(get_node_from_token(tokens, "node_a_id")),
-                    to_string(get_node_from_token(tokens, "node_b_id")));
-                if (reply == "RPC failed") {
-                  json_result = "";
-                  http_header = gen_result_http_header(500, status_code_mp[500], 0);
-                }else {
-                  int status_code = graph.addEdge(get_node_from_token(tokens, "node_a_id"), get_node_from_token(tokens, "node_b_id"));
-                  json_result = status_code == 200 ? param_json : "";
-                  http_header = gen_result_http_header(status_code, status_code_mp[status_code], json_result.size());
-                  if (status_code == 200) {
-                    slog.add_log_entry(OP_ADD_EDGE, get_node_from_token(tokens, "node_a_id"), get_node_from_token(tokens, "node_b_id"));
-                  }
-                }
-              }else {
-                //only primary node in the chain
-                int status_code = graph.addEdge(get_node_from_token(tokens, "node_a_id"), get_node_from_token(tokens, "node_b_id"));
-                json_result = status_code == 200 ? param_json : "";
-                http_header = gen_result_http_header(status_code, status_code_mp[status_code], json_result.size());
-                if (status_code == 200) {
-                  slog.add_log_entry(OP_ADD_EDGE, get_node_from_token(tokens, "node_a_id"), get_node_from_token(tokens, "node_b_id"));
-                }
-              }
-            }
-          }else if (request == "remove_node") {
-            if (slog.log_is_full()) {
-              json_result = "";
-              http_header = gen_result_http_header(507, status_code_mp[507], 0);
-            }else {
-              if (grpc_client != nullptr) {
-                string reply = grpc_client->SendRemoveNode(to_string(get_node_from_token(tokens, "node_id")));
-                if (reply == "RPC failed") {
-                  json_result = "";
-                  http_header = gen_result_http_header(500, status_code_mp[500], 0);
-                }else {
-                  int status_code = graph.removeNode(get_node_from_token(tokens, "node_id"));
-                  json_result = status_code == 200 ? param_json : "";
-                  http_header = gen_result_http_header(status_code, status_code_mp[status_code], json_result.size());
-                  if (status_code == 200) {
-                    slog.add_log_entry(OP_REMOVE_NODE, get_node_from_token(tokens, "node_id"), 0);
-                  }
-                }
-              }else {
-                //only primary node in the chain
-                int status_code = graph.removeNode(get_node_from_token(tokens, "node_id"));
-                json_result = status_code == 200 ? param_json : "";
-                http_header = gen_result_http_header(status_code, status_code_mp[status_code], json_result.size());
-                if (status_code == 200) {
-                  slog.add_log_entry(OP_REMOVE_NODE, get_node_from_token(tokens, "node_id"), 0);
-                }  
-              }
-            }
-          }else if (request == "remove_edge") {
-            if (slog.log_is_full()) {
-              json_result = "";
-              http_header = gen_result_http_header(507, status_code_mp[507], 0);
-            }else {
-              if (grpc_client != nullptr) {
-                string reply = grpc_client->SendRemoveEdge(to_string(get_node_from_token(tokens, "node_a_id")),
-                    to_string(get_node_from_token(tokens, "node_b_id")));
-                if (reply == "RPC failed") {
-                  json_result = "";
-                  http_header = gen_result_http_header(500, status_code_mp[500], 0);
-                }else {
-                  int status_code = graph.removeEdge(get_node_from_token(tokens, "node_a_id"), get_node_from_token(tokens, "node_b_id"));
-                  json_result = status_code == 200 ? param_json : "";
-                  http_header = gen_result_http_header(status_code, status_code_mp[status_code], json_result.size());
-                  if (status_code == 200) {
-                    slog.add_log_entry(OP_REMOVE_EDGE, get_node_from_token(tokens, "node_a_id"), get_node_from_token(tokens, "node_b_id"));
-                  }
-                }
-              }else {
-                //only primary node in the chain
-                int status_code = graph.removeEdge(get_node_from_token(tokens, "node_a_id"), get_node_from_token(tokens, "node_b_id"));
-                json_result = status_code == 200 ? param_json : "";
-                http_header = gen_result_http_header(status_code, status_code_mp[status_code], json_result.size());
-                if (status_code == 200) {
-                  slog.add_log_entry(OP_REMOVE_EDGE, get_node_from_token(tokens, "node_a_id"), get_node_from_token(tokens, "node_b_id"));
-                }
-              }
-            }
-          }else if (request == "get_node") {
-            pair<int, int> status = graph.getNode(get_node_from_token(tokens, "node_id"));
-            char buf[1000];
-            if (status.second == 1) {
-              json_emit(buf, sizeof(buf), "{ s: T }", "in_graph");
-            }else {
-              json_emit(buf, sizeof(buf), "{ s: F }", "in_graph");
-            }
-            json_result = string(buf);
-            http_header = gen_result_http_header(status.first, status_code_mp[status.first], json_result.size());
-          }else if (request == "get_edge") {
-            pair<int, int> status = graph.getEdge(get_node_from_token(tokens, "node_a_id"), get_node_from_token(tokens, "node_b_id"));
-            char buf[1000];
-            if (status.first == 200) {
-              if (status.second == 1) {
-                json_emit(buf, sizeof(buf), "{ s: T }", "in_graph");
-              }else {
-                json_emit(buf, sizeof(buf), "{ s: F }", "in_graph");
-              }
-              json_result = string(buf);
-            }else {
-              json_result = "";
-            }
-            http_header = gen_result_http_header(status.first, status_code_mp[status.first], json_result.size());
-          }else if (request == "get_neighbors") {
-            pair<int, vector<uint64_t>> status = graph.getNeighbors(get_node_from_token(tokens, "node_id"));
-            if (status.first == 200) {
-              json_result = gen_neighbor_json_result(get_node_from_token(tokens, "node_id"), status.second);
-            }else {
-              json_result = "";
-            }
-            http_header = gen_result_http_header(status.first, status_code_mp[status.first], json_result.size());
-          }else if (request == "shortest_path") {
-            pair<int, int> status = graph.shortestPath(get_node_from_token(tokens, "node_a_id"), get_node_from_token(tokens, "node_b_id"));
-            char buf[1000];
-            if (status.first == 200) {
-              json_emit(buf, sizeof(buf), "{ s: i }", "distance", status.second);
-              json_result = string(buf);
-            }else {
-              json_result = "";
-            }
-            http_header = gen_result_http_header(status.first, status_code_mp[status.first], json_result.size());
-          }else if (request == "checkpoint") {
-            if (slog.log_is_full()) {
-              json_result = "";
-              http_header = gen_result_http_header(507, status_code_mp[507], 0);
-            }else {
-              slog.checkpoint();
-              json_result = "";
-              http_header = gen_result_http_header(200, status_code_mp[200], 0);
-            }
+          if (handle_http_request(nc, hm)) {
+            handle_pipelined_requests(nc, hm);
           }
-          http_result = http_header + json_result;
-          mg_printf(nc, "%s", http_result.c_str());
-          free(tokens);
         }
       } else {
         mg_serve_http(nc, hm, s_http_server_opts); /* Serve static content */
       }
       break;
+    case MG_EV_SEND:
+      pump_neighbor_stream(nc);
+      break;
+    case MG_EV_POLL:
+      //close keep-alive connections idle for HTTP_KEEP_ALIVE_TIMEOUT
+      if (nc->listener != nullptr and mg_time() - nc->last_io_time > HTTP_KEEP_ALIVE_TIMEOUT
+          and nc->send_mbuf.len == 0 and !has_pending_response(nc)) {
+        nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+      }
+      break;
+    case MG_EV_CLOSE:
+      drop_pending_responses(nc);
+      neighbor_streams.erase(nc);
+      break;
     default:
       break;
   }
@@ -262,6 +697,35 @@ int main(int argc, const char * argv[]) {
 
   bool format = false;
 
+  uint32_t group_commit_delay_us = 0;
+
+  uint32_t checkpoint_compact_percent = 50;
+
+  //CHECKPT_FORMAT_* new checkpoints are written in
+  uint32_t checkpoint_format = CHECKPT_FORMAT_VARINT;
+
+  //LOG_FORMAT_* new log blocks are written in
+  uint32_t log_format = LOG_FORMAT_VARINT;
+
+  uint32_t checksum_type = CHECKSUM_CRC32C;
+
+  //log fill percentage that triggers a checkpoint, 0 answers 507 once the
+  //log is full until a checkpoint is requested
+  uint32_t checkpoint_log_percent = 50;
+
+  //threads checking and replaying the log at startup
+  uint32_t recovery_threads = thread::hardware_concurrency();
+
+  int log_io = LOG_IO_MMAP;
+
+  int storage_type = STORAGE_DEVICE;
+
+  bool pipelined_replication = true;
+
+  //rpc version spoken to the next node, 1 until every node of the chain
+  //serves rpcsenderV2
+  int rpc_version = 1;
+
   string mongoose_port, grpc_port, ip_next, port_next;
 
   if (argc < 2) {
@@ -289,6 +753,46 @@ int main(int argc, const char * argv[]) {
       ip_next = right;
     }else if (left == "PORT_NEXT") {
       port_next = right;
+    }else if (left == "LOG_IO") {
+      if (right == "mmap_block") {
+        log_io = LOG_IO_MMAP_BLOCK;
+      }else if (right == "pwrite") {
+        log_io = LOG_IO_PWRITE;
+      }else if (right == "direct") {
+        log_io = LOG_IO_DIRECT;
+      }else {
+        log_io = LOG_IO_MMAP;
+      }
+    }else if (left == "STORAGE") {
+      if (right == "segments") {
+        storage_type = STORAGE_SEGMENTS;
+      }else if (right == "memory") {
+        storage_type = STORAGE_MEMORY;
+      }else {
+        storage_type = STORAGE_DEVICE;
+      }
+    }else if (left == "LOG_FORMAT") {
+      log_format = stoul(right);
+    }else if (left == "CHECKSUM") {
+      checksum_type = right == "xor" ? CHECKSUM_XOR : CHECKSUM_CRC32C;
+    }else if (left == "HTTP_WORKERS") {
+      http_workers = stoi(right);
+    }else if (left == "GROUP_COMMIT_DELAY_US") {
+      group_commit_delay_us = stoul(right);
+    }else if (left == "CHECKPOINT_MODE") {
+      background_checkpoint = right != "blocking";
+    }else if (left == "CHECKPOINT_COMPACT_PERCENT") {
+      checkpoint_compact_percent = stoul(right);
+    }else if (left == "CHECKPOINT_FORMAT") {
+      checkpoint_format = stoul(right);
+    }else if (left == "CHECKPOINT_LOG_PERCENT") {
+      checkpoint_log_percent = stoul(right);
+    }else if (left == "RECOVERY_THREADS") {
+      recovery_threads = stoul(right);
+    }else if (left == "REPLICATION") {
+      pipelined_replication = right != "sync";
+    }else if (left == "RPC_VERSION") {
+      rpc_version = stoi(right);
     }
   }
   fin.close();
@@ -296,35 +800,63 @@ int main(int argc, const char * argv[]) {
   s_http_port = mongoose_port.c_str();
 
   slog.bind_graph(&graph);
+  slog.set_log_io(log_io);
+  slog.set_storage(storage_type);
   slog.attach_log(devfile);
+  slog.set_log_format(log_format);
+  slog.set_checksum_type(checksum_type);
+  slog.set_group_commit_delay(group_commit_delay_us);
+  slog.set_checkpoint_compaction(checkpoint_compact_percent);
+  slog.set_checkpoint_format(checkpoint_format);
+  slog.set_recovery_threads(recovery_threads);
 
   if (format) {
     slog.format();
   } else {
     slog.init_server_log();
   }
+  slog.start_checkpointer(checkpoint_log_percent);
+
+  //initialized early, replication acks and asynchronous log writes wake up
+  //the event loop with mg_broadcast
+  mg_mgr_init(&mgr, NULL);
+  slog.set_durable_callback([]() {
+    mg_broadcast(&mgr, wakeup_handler, (void*)"w", 1);
+  });
 
   //if has next node, start a client to connect to next node in chain
   if (ip_next != "-1") {
     string addr_next = ip_next + ":" + port_next;
-    grpc_client = new rpcsenderClient(grpc::CreateChannel(
-          addr_next, grpc::InsecureChannelCredentials()));
+    shared_ptr<grpc::Channel> channel = grpc::CreateChannel(addr_next, grpc::InsecureChannelCredentials());
+    grpc_client = new rpcsenderClient(channel, rpc_version);
+    //the replication stream only exists in rpcsenderV2
+    if (pipelined_replication and rpc_version >= 2) {
+      replicator = new chainReplicator(channel);
+      replicator->SetAckCallback([]() {
+        mg_broadcast(&mgr, wakeup_handler, (void*)"w", 1);
+      });
+    }
   }
 
   //create a thread to listen for grpc request
   rpc_service.bind_graph(&graph);
   rpc_service.bind_log(&slog);
   rpc_service.bind_grpc_client(grpc_client);
+  rpc_service.bind_replicator(replicator);
+  rpc_service.bind_write_mutex(&write_mutex);
 
   thread grpc_thread(RunRPCServer, "0.0.0.0:" + grpc_port);
   grpc_thread.detach();
 
 
-  struct mg_mgr mgr;
   struct mg_connection *nc;
 
+  if (http_workers > 0) {
+    workers = new worker_pool();
+    workers->start(http_workers);
+  }
+
   /* Open listening socket */
-  mg_mgr_init(&mgr, NULL);
   nc = mg_bind(&mgr, s_http_port, ev_handler);
   mg_set_protocol_http_websocket(nc);
   s_http_server_opts.document_root = "web_root";
@@ -334,12 +866,15 @@ int main(int argc, const char * argv[]) {
 
 
   /* Run event loop until signal is received */
-  printf("Starting RESTful server on port %s\n", s_http_port);
+  debug_info("Starting RESTful server on port %s.", s_http_port);
   while (s_sig_num == 0) {
-    mg_mgr_poll(&mgr, 1000);
+    //wake up in time to release a pending group commit batch
+    int timeout_ms = pending_responses.empty() ? 1000 : group_commit_delay_us / 1000 + 1;
+    mg_mgr_poll(&mgr, timeout_ms);
+    release_pending_responses();
   }
 
-  printf("Exiting on signal %d\n", s_sig_num);
+  debug_info("Exiting on signal %d.", s_sig_num);
 
   return 0;
 }
@@ -0,0 +1,130 @@
+#include "debug.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <inttypes.h>
+#include <mutex>
+#include <thread>
+
+//one queued message. seq says whose turn the slot is: the writer of
+//position pos claims it when seq == pos, the writer thread prints it when
+//seq == pos + 1 and hands it to position pos + DEBUG_RING_SIZE
+struct debug_slot_t {
+  std::atomic<uint64_t> seq;
+  int level;
+  char text[DEBUG_MESSAGE_SIZE];
+};
+
+struct debug_ring_t {
+  debug_slot_t slots[DEBUG_RING_SIZE];
+  //next position to print / to claim
+  std::atomic<uint64_t> head;
+  std::atomic<uint64_t> tail;
+  //messages that found the ring full since the last print
+  std::atomic<uint64_t> dropped;
+  std::atomic<bool> started;
+  //held while printing, so messages come out once and in order
+  std::mutex print_mutex;
+  std::mutex wake_mutex;
+  std::condition_variable wake;
+
+  debug_ring_t() : head(0), tail(0), dropped(0), started(false) {
+    for (uint64_t i = 0; i < DEBUG_RING_SIZE; ++i) {
+      slots[i].seq.store(i);
+    }
+  }
+};
+
+static const char* level_names[] = {"TRACE", "DEBUG", "INFO", "WARN", "ERROR"};
+
+//never destroyed, threads still running at exit may use it
+static debug_ring_t& debug_ring() {
+  static debug_ring_t* ring = new debug_ring_t();
+  return *ring;
+}
+
+static void print_ring(debug_ring_t& ring) {
+  std::lock_guard<std::mutex> lk(ring.print_mutex);
+  uint64_t pos = ring.head.load(std::memory_order_relaxed);
+  bool printed = false;
+  while (true) {
+    debug_slot_t& slot = ring.slots[pos % DEBUG_RING_SIZE];
+    if (slot.seq.load(std::memory_order_acquire) != pos + 1) {
+      break;
+    }
+    printf("%s %s\n", level_names[slot.level], slot.text);
+    slot.seq.store(pos + DEBUG_RING_SIZE, std::memory_order_release);
+    pos++;
+    printed = true;
+  }
+  ring.head.store(pos, std::memory_order_relaxed);
+  uint64_t dropped = ring.dropped.exchange(0);
+  if (dropped > 0) {
+    printf("WARN %" PRIu64 " debug messages dropped.\n", dropped);
+  }
+  if (printed || dropped > 0) {
+    fflush(stdout);
+  }
+}
+
+static void run_printer(debug_ring_t* ring) {
+  std::unique_lock<std::mutex> lk(ring->wake_mutex);
+  while (true) {
+    lk.unlock();
+    print_ring(*ring);
+    lk.lock();
+    //a wakeup can be missed, writers don't take wake_mutex
+    ring->wake.wait_for(lk, std::chrono::milliseconds(100));
+  }
+}
+
+static void start_printer(debug_ring_t& ring) {
+  bool started = false;
+  if (ring.started.load(std::memory_order_acquire)
+      || !ring.started.compare_exchange_strong(started, true)) {
+    return;
+  }
+  std::thread(run_printer, &ring).detach();
+  atexit(debug_flush);
+}
+
+void debug_write(int level, const char* fmt, ...) {
+  debug_ring_t& ring = debug_ring();
+  start_printer(ring);
+  uint64_t pos = ring.tail.load(std::memory_order_relaxed);
+  debug_slot_t* slot;
+  while (true) {
+    slot = &ring.slots[pos % DEBUG_RING_SIZE];
+    uint64_t seq = slot->seq.load(std::memory_order_acquire);
+    if (seq == pos) {
+      if (ring.tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+        break;
+      }
+    }else if (seq < pos) {
+      //the printer is a whole ring behind
+      ring.dropped.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }else {
+      pos = ring.tail.load(std::memory_order_relaxed);
+    }
+  }
+  slot->level = level;
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(slot->text, DEBUG_MESSAGE_SIZE, fmt, args);
+  va_end(args);
+  slot->seq.store(pos + 1, std::memory_order_release);
+  //the printer wakes up on its own soon, only hurry it for a filling ring
+  //and for problems
+  if (level >= DEBUG_LEVEL_WARN || pos + 1 - ring.head.load(std::memory_order_relaxed) >= DEBUG_RING_SIZE / 2) {
+    ring.wake.notify_one();
+  }
+}
+
+void debug_flush() {
+  print_ring(debug_ring());
+}
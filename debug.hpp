@@ -1,13 +1,47 @@
 #ifndef _DEBUG_H
 #define _DEBUG_H
 
-#include <stdio.h>
 #include "types.hpp"
 
-void print_debug(const char* info) {
-  if (DEBUG) {
-    printf("%s\n", info);
-  }
-}
+//format a message into the debug ring without taking a lock. a writer
+//thread prints the queued messages to stdout in order. a message finding
+//the ring full is dropped and counted. messages of a forked child are
+//never printed
+void debug_write(int level, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+//print every message queued so far, also done at exit
+void debug_flush();
+
+//debug_<level>(fmt, ...) queues a message of that level. below DEBUG_LEVEL
+//the call and its arguments are compiled out
+#if DEBUG_LEVEL <= DEBUG_LEVEL_TRACE
+#define debug_trace(...) debug_write(DEBUG_LEVEL_TRACE, __VA_ARGS__)
+#else
+#define debug_trace(...) ((void)0)
+#endif
+
+#if DEBUG_LEVEL <= DEBUG_LEVEL_DEBUG
+#define debug_debug(...) debug_write(DEBUG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define debug_debug(...) ((void)0)
+#endif
+
+#if DEBUG_LEVEL <= DEBUG_LEVEL_INFO
+#define debug_info(...) debug_write(DEBUG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define debug_info(...) ((void)0)
+#endif
+
+#if DEBUG_LEVEL <= DEBUG_LEVEL_WARN
+#define debug_warn(...) debug_write(DEBUG_LEVEL_WARN, __VA_ARGS__)
+#else
+#define debug_warn(...) ((void)0)
+#endif
+
+#if DEBUG_LEVEL <= DEBUG_LEVEL_ERROR
+#define debug_error(...) debug_write(DEBUG_LEVEL_ERROR, __VA_ARGS__)
+#else
+#define debug_error(...) ((void)0)
+#endif
 
 #endif
@@ -1,16 +1,30 @@
 #include "graph.hpp"
 
+#include <algorithm>
 #include <vector>
-#include <queue>
 #include <cstdint>
 #include <unordered_map>
 #include <unordered_set>
 
 using namespace std;
 
+Graph::Graph() {
+  pthread_rwlockattr_t attr;
+  pthread_rwlockattr_init(&attr);
+  //don't let a stream of readers starve the writers
+  pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+  pthread_rwlock_init(&lock, &attr);
+  pthread_rwlockattr_destroy(&attr);
+}
+
+Graph::~Graph() {
+  pthread_rwlock_destroy(&lock);
+}
+
 int Graph::addNode(uint64_t node_id) {
   if (g.find(node_id) == g.end()) {
-    g[node_id] = unordered_set<uint64_t>();
+    g[node_id] = neighbor_set_t();
+    dirty.insert(node_id);
     return 200;
   }else {
     //The node already exists in the graph
@@ -30,6 +44,8 @@ int Graph::addEdge(uint64_t node_id_a, uint64_t node_id_b) {
   //add the edge
   g[node_id_a].insert(node_id_b);
   g[node_id_b].insert(node_id_a);
+  dirty.insert(node_id_a);
+  dirty.insert(node_id_b);
   return 200;
 }
 
@@ -41,8 +57,10 @@ int Graph::removeNode(uint64_t node_id) {
   //remove the node
   for (auto it = g[node_id].begin(); it != g[node_id].end(); ++it) {
     g[*it].erase(node_id);
+    dirty.insert(*it);
   }
   g.erase(node_id);
+  dirty.insert(node_id);
   return 200;
 }
 
@@ -54,9 +72,26 @@ int Graph::removeEdge(uint64_t node_id_a, uint64_t node_id_b) {
   //remove edge
   g[node_id_a].erase(node_id_b);
   g[node_id_b].erase(node_id_a);
+  dirty.insert(node_id_a);
+  dirty.insert(node_id_b);
   return 200;
 }
 
+int Graph::applyOperation(uint32_t opcode, uint64_t node_id_a, uint64_t node_id_b) {
+  switch (opcode) {
+    case OP_ADD_NODE:
+      return addNode(node_id_a);
+    case OP_ADD_EDGE:
+      return addEdge(node_id_a, node_id_b);
+    case OP_REMOVE_NODE:
+      return removeNode(node_id_a);
+    case OP_REMOVE_EDGE:
+      return removeEdge(node_id_a, node_id_b);
+    default:
+      return 400;
+  }
+}
+
 pair<int, int> Graph::getNode(uint64_t node_id) {
   pair<int, int> res = make_pair(200, 1);
   if (g.find(node_id) == g.end()) {
@@ -67,13 +102,15 @@ pair<int, int> Graph::getNode(uint64_t node_id) {
 
 pair<int, int> Graph::getEdge(uint64_t node_id_a, uint64_t node_id_b) {
   pair<int, int> res = make_pair(200, 1);
-  if (g.find(node_id_a) == g.end() or g.find(node_id_b) == g.end()) {
+  auto iter_a = g.find(node_id_a);
+  if (iter_a == g.end() or g.find(node_id_b) == g.end()) {
     //at least one vertice doesn't exist
     res.first = 400;
     res.second = 0;
     return res;
   }
-  if (g[node_id_a].find(node_id_b) == g[node_id_a].end()) {
+  //only find() on the read paths, they run concurrently under a read lock
+  if (iter_a->second.find(node_id_b) == iter_a->second.end()) {
     //the edge doesn't exist
     res.second = 0;
   }
@@ -82,42 +119,108 @@ pair<int, int> Graph::getEdge(uint64_t node_id_a, uint64_t node_id_b) {
 
 pair<int, vector<uint64_t> > Graph::getNeighbors(uint64_t node_id) {
   pair<int, vector<uint64_t> > res = make_pair(200, vector<uint64_t>());
-  if (g.find(node_id) == g.end()) {
+  auto node = g.find(node_id);
+  if (node == g.end()) {
     res.first = 400;
     return res;
   }
-  unordered_set<uint64_t>::iterator iter = g[node_id].begin();
-  while (iter != g[node_id].end()) {
+  res.second.reserve(node->second.size());
+  auto iter = node->second.begin();
+  while (iter != node->second.end()) {
     res.second.push_back(*iter);
     iter++;
   }
   return res;
 }
 
+pair<int, bool> Graph::getNeighborPage(uint64_t node_id, uint64_t from, size_t limit, vector<uint64_t>& page) {
+  pair<int, bool> res = make_pair(200, false);
+  page.clear();
+  auto node = g.find(node_id);
+  if (node == g.end()) {
+    res.first = 400;
+    return res;
+  }
+  if (limit == 0) {
+    res.second = !node->second.empty();
+    return res;
+  }
+  page.reserve(min(limit, node->second.size()));
+  //max-heap of the limit smallest neighbors >= from seen so far
+  for (auto iter = node->second.begin(); iter != node->second.end(); ++iter) {
+    if (*iter < from) {
+      continue;
+    }
+    if (page.size() < limit) {
+      page.push_back(*iter);
+      push_heap(page.begin(), page.end());
+      continue;
+    }
+    res.second = true;
+    if (*iter < page.front()) {
+      pop_heap(page.begin(), page.end());
+      page.back() = *iter;
+      push_heap(page.begin(), page.end());
+    }
+  }
+  sort_heap(page.begin(), page.end());
+  return res;
+}
+
+//expand one whole BFS level of one side of a bidirectional search.
+//return the shortest a-b distance through a vertex already reached by the
+//other side, or -1 if the two searches haven't met yet
+static int expand_frontier(adjacency_t& g, vector<uint64_t>& frontier,
+    unordered_map<uint64_t, int>& dist, unordered_map<uint64_t, int>& other_dist) {
+  vector<uint64_t> next;
+  int shortest = -1;
+  for (uint64_t node : frontier) {
+    int d = dist[node];
+    neighbor_set_t& neighbors = g.find(node)->second;
+    for (auto iter = neighbors.begin(); iter != neighbors.end(); ++iter) {
+      auto other = other_dist.find(*iter);
+      if (other != other_dist.end()) {
+        //the frontiers meet, finish the level to get the minimum
+        if (shortest == -1 or d + 1 + other->second < shortest) {
+          shortest = d + 1 + other->second;
+        }
+      }
+      if (dist.find(*iter) == dist.end()) {
+        dist[*iter] = d + 1;
+        next.push_back(*iter);
+      }
+    }
+  }
+  frontier.swap(next);
+  return shortest;
+}
+
 pair<int, int> Graph::shortestPath(uint64_t node_id_a, uint64_t node_id_b) {
   pair<int, int> res;
   if (g.find(node_id_a) == g.end() or g.find(node_id_b) == g.end()) {
     res.first = 400;
     return res;
   }
-  queue<pair<uint64_t, int> > q;
-  q.push(make_pair(node_id_a, 0));
+  res.first = 200;
+  res.second = 0;
+  if (node_id_a == node_id_b) {
+    return res;
+  }
+  //bidirectional BFS: always expand the side with the smaller frontier,
+  //stop as soon as the two searches meet or one side runs out of vertices
+  vector<uint64_t> frontier_a(1, node_id_a), frontier_b(1, node_id_b);
+  unordered_map<uint64_t, int> dist_a, dist_b;
+  dist_a[node_id_a] = 0;
+  dist_b[node_id_b] = 0;
   int shortest = -1;
-  unordered_set<uint64_t> visited;
-  visited.insert(node_id_a);
-  while (!q.empty()) {
-    uint64_t node = q.front().first;
-    int dist = q.front().second;
-    q.pop();
-    if (node == node_id_b) {
-      shortest = dist;
-      break;
+  while (!frontier_a.empty() and !frontier_b.empty()) {
+    if (frontier_a.size() <= frontier_b.size()) {
+      shortest = expand_frontier(g, frontier_a, dist_a, dist_b);
+    }else {
+      shortest = expand_frontier(g, frontier_b, dist_b, dist_a);
     }
-    for (unordered_set<uint64_t>::iterator iter = g[node].begin(); iter != g[node].end(); ++iter) {
-      if (visited.find(*iter) == visited.end()) {
-        visited.insert(*iter);
-        q.push(make_pair(*iter, dist + 1));
-      }
+    if (shortest != -1) {
+      break;
     }
   }
   if (shortest == -1) {
@@ -125,7 +228,6 @@ pair<int, int> Graph::shortestPath(uint64_t node_id_a, uint64_t node_id_b) {
     res.first = 204;
     return res;
   }
-  res.first = 200;
   res.second = shortest;
   return res;
 }
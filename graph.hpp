@@ -1,9 +1,13 @@
 #ifndef _GRAPH_H
 #define _GRAPH_H
 
+#include <cstdint>
+#include <pthread.h>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
+#include "adjacency.hpp"
+#include "types.hpp"
 
 using namespace std;
 
@@ -14,9 +18,30 @@ struct GNode {
   }
 };
 
+#if COMPACT_ADJACENCY
+typedef neighbor_set neighbor_set_t;
+typedef adjacency_map adjacency_t;
+#else
+typedef unordered_set<uint64_t> neighbor_set_t;
+typedef unordered_map<uint64_t, neighbor_set_t> adjacency_t;
+#endif
+
 struct Graph {
 
-  unordered_map<uint64_t, unordered_set<uint64_t> > g;
+  adjacency_t g;
+
+  //vertices whose adjacency changed since the last checkpoint, maintained
+  //by the mutations below and cleared by server_log::checkpoint
+  unordered_set<uint64_t> dirty;
+
+  //readers of g share the lock, mutations take it exclusively.
+  //the methods below don't lock, callers hold a graph_read_guard or
+  //graph_write_guard around them
+  pthread_rwlock_t lock;
+
+  Graph();
+
+  ~Graph();
 
   int addNode(uint64_t node_id);
 
@@ -32,8 +57,40 @@ struct Graph {
 
   pair<int, vector<uint64_t> > getNeighbors(uint64_t node_id);
 
+  //the limit smallest neighbors >= from into page in increasing order, and
+  //whether more of them follow. pages stay consistent under mutations in
+  //between: a neighbor present all along is in exactly one page. a page is
+  //one scan of the neighbor set, the memory it takes is the page itself
+  pair<int, bool> getNeighborPage(uint64_t node_id, uint64_t from, size_t limit, vector<uint64_t>& page);
+
   pair<int, int> shortestPath(uint64_t node_id_a, uint64_t node_id_b);
+
+  //apply one OP_* mutation, node_id_b is ignored for node operations
+  int applyOperation(uint32_t opcode, uint64_t node_id_a, uint64_t node_id_b);
 };
 
+struct graph_read_guard {
+  pthread_rwlock_t* lock;
+
+  explicit graph_read_guard(struct Graph* graph) : lock(&graph->lock) {
+    pthread_rwlock_rdlock(lock);
+  }
+
+  ~graph_read_guard() {
+    pthread_rwlock_unlock(lock);
+  }
+};
+
+struct graph_write_guard {
+  pthread_rwlock_t* lock;
+
+  explicit graph_write_guard(struct Graph* graph) : lock(&graph->lock) {
+    pthread_rwlock_wrlock(lock);
+  }
+
+  ~graph_write_guard() {
+    pthread_rwlock_unlock(lock);
+  }
+};
 
 #endif
@@ -0,0 +1,163 @@
+#include "io_ring.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <linux/io_uring.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+static int ring_setup(uint32_t entries, struct io_uring_params* p) {
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int ring_enter(int fd, uint32_t to_submit, uint32_t min_complete, uint32_t flags) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+bool io_ring::init(uint32_t depth) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  ring_fd = ring_setup(depth, &p);
+  if (ring_fd < 0) {
+    return false;
+  }
+  entries = p.sq_entries;
+  sq_map_size = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+  cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    //both rings live in one mapping
+    sq_map_size = sq_map_size > cq_map_size ? sq_map_size : cq_map_size;
+  }
+  sq_map = mmap(NULL, sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+  if (sq_map == MAP_FAILED) {
+    sq_map = nullptr;
+    close();
+    return false;
+  }
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    cq_map = sq_map;
+  }else {
+    cq_map = mmap(NULL, cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+    if (cq_map == MAP_FAILED) {
+      cq_map = nullptr;
+      close();
+      return false;
+    }
+  }
+  sqe_map_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  sqe_map = mmap(NULL, sqe_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+  if (sqe_map == MAP_FAILED) {
+    sqe_map = nullptr;
+    close();
+    return false;
+  }
+  char* sq = (char*)sq_map;
+  char* cq = (char*)cq_map;
+  sq_head = (uint32_t*)(sq + p.sq_off.head);
+  sq_tail = (uint32_t*)(sq + p.sq_off.tail);
+  sq_mask = *(uint32_t*)(sq + p.sq_off.ring_mask);
+  sq_array = (uint32_t*)(sq + p.sq_off.array);
+  cq_head = (uint32_t*)(cq + p.cq_off.head);
+  cq_tail = (uint32_t*)(cq + p.cq_off.tail);
+  cq_mask = *(uint32_t*)(cq + p.cq_off.ring_mask);
+  cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+  sqes = (struct io_uring_sqe*)sqe_map;
+  return true;
+}
+
+bool io_ring::ready() {
+  return ring_fd >= 0;
+}
+
+bool io_ring::submit(uint8_t opcode, int fd, const void* buf, uint32_t len, off_t pos,
+    uint64_t tag, bool barrier) {
+  if (ring_fd < 0) {
+    return false;
+  }
+  uint32_t tail = *sq_tail;
+  if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= entries) {
+    return false;
+  }
+  uint32_t index = tail & sq_mask;
+  struct io_uring_sqe* sqe = &sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = opcode;
+  sqe->fd = fd;
+  sqe->off = (uint64_t)pos;
+  sqe->addr = (uint64_t)(uintptr_t)buf;
+  sqe->len = len;
+  sqe->user_data = tag;
+  if (opcode == IORING_OP_WRITE) {
+    sqe->rw_flags = RWF_DSYNC;
+  }
+  if (barrier) {
+    sqe->flags = IOSQE_IO_DRAIN;
+  }
+  sq_array[index] = index;
+  __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+  //a full completion queue only delays the submission
+  int ret;
+  while ((ret = ring_enter(ring_fd, 1, 0, 0)) < 0 && (errno == EINTR || errno == EAGAIN || errno == EBUSY)) {
+    sched_yield();
+  }
+  if (ret == 1 || __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) != tail) {
+    //the kernel took the sqe, its completion reports any error
+    return true;
+  }
+  //take the sqe back, the caller reuses buf and tag and the next
+  //io_uring_enter must not submit it
+  __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+  return false;
+}
+
+bool io_ring::write(int fd, const void* buf, uint32_t len, off_t pos, uint64_t tag, bool barrier) {
+  return submit(IORING_OP_WRITE, fd, buf, len, pos, tag, barrier);
+}
+
+bool io_ring::nop(uint64_t tag) {
+  return submit(IORING_OP_NOP, -1, nullptr, 0, 0, tag, false);
+}
+
+bool io_ring::wait(uint64_t* tag, int32_t* res) {
+  while (ring_fd >= 0) {
+    uint32_t head = *cq_head;
+    if (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+      struct io_uring_cqe* cqe = &cqes[head & cq_mask];
+      *tag = cqe->user_data;
+      *res = cqe->res;
+      __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+      return true;
+    }
+    if (ring_enter(ring_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+      return false;
+    }
+  }
+  return false;
+}
+
+void io_ring::close() {
+  if (sqe_map != nullptr) {
+    munmap(sqe_map, sqe_map_size);
+    sqe_map = nullptr;
+  }
+  if (cq_map != nullptr && cq_map != sq_map) {
+    munmap(cq_map, cq_map_size);
+  }
+  cq_map = nullptr;
+  if (sq_map != nullptr) {
+    munmap(sq_map, sq_map_size);
+    sq_map = nullptr;
+  }
+  if (ring_fd >= 0) {
+    ::close(ring_fd);
+    ring_fd = -1;
+  }
+}
+
+io_ring::~io_ring() {
+  close();
+}
@@ -0,0 +1,60 @@
+#ifndef _IO_RING_H
+#define _IO_RING_H
+
+#include <cstdint>
+#include <cstddef>
+#include <sys/types.h>
+
+//minimal io_uring on the raw system calls: one thread queues writes, one
+//thread waits for their completions. a write completes once its data is on
+//the device (RWF_DSYNC), so no separate sync is needed
+class io_ring {
+  private:
+    int ring_fd = -1;
+    uint32_t entries = 0;
+
+    void* sq_map = nullptr;
+    size_t sq_map_size = 0;
+    void* cq_map = nullptr;
+    size_t cq_map_size = 0;
+    void* sqe_map = nullptr;
+    size_t sqe_map_size = 0;
+
+    uint32_t* sq_head = nullptr;
+    uint32_t* sq_tail = nullptr;
+    uint32_t sq_mask = 0;
+    uint32_t* sq_array = nullptr;
+    uint32_t* cq_head = nullptr;
+    uint32_t* cq_tail = nullptr;
+    uint32_t cq_mask = 0;
+    struct io_uring_sqe* sqes = nullptr;
+    struct io_uring_cqe* cqes = nullptr;
+
+    //queue one sqe and hand it to the kernel. false if the queue is full
+    //or the kernel didn't take it, the sqe is dropped then
+    bool submit(uint8_t opcode, int fd, const void* buf, uint32_t len, off_t pos,
+        uint64_t tag, bool barrier);
+
+  public:
+    //set up a ring of the given depth, false if the kernel has no io_uring
+    bool init(uint32_t depth);
+
+    bool ready();
+
+    //write len bytes of buf at pos. a barrier write starts only after every
+    //earlier write completed. false if it could not be submitted
+    bool write(int fd, const void* buf, uint32_t len, off_t pos, uint64_t tag, bool barrier);
+
+    //complete right away with tag, to wake up the thread in wait
+    bool nop(uint64_t tag);
+
+    //block until a request completes, return its tag and result: the bytes
+    //written or -errno. false if the ring is broken
+    bool wait(uint64_t* tag, int32_t* res);
+
+    void close();
+
+    ~io_ring();
+};
+
+#endif
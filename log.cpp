@@ -7,25 +7,270 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <cstddef>
+#include <algorithm>
 #include <inttypes.h>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <functional>
+#include <sys/wait.h>
 #include "graph.hpp"
 #include "types.hpp"
 #include "debug.hpp"
 
+//tag of the nop that stops the reaper thread
+static const uint64_t REAPER_STOP = UINT64_MAX;
+
+//run fn(0) .. fn(threads - 1) in parallel, fn(0) on the calling thread
+static void run_threads(uint32_t threads, const std::function<void(uint32_t)>& fn) {
+  std::vector<std::thread> workers;
+  for (uint32_t t = 1; t < threads; ++t) {
+    workers.emplace_back(fn, t);
+  }
+  fn(0);
+  for (std::thread& w : workers) {
+    w.join();
+  }
+}
+
+//bytes a CHECKPT_FORMAT_VARINT record header / neighbor take at most
+static const uint32_t CHECKPT_HEADER_MAX = 20;
+static const uint32_t CHECKPT_VARINT_MAX = 10;
+
+//LEB128: 7 bits per byte, low bits first, the high bit set on all but the last
+static inline uint32_t put_varint(uint8_t* p, uint64_t v) {
+  uint32_t n = 0;
+  while (v >= 0x80) {
+    p[n++] = (uint8_t)v | 0x80;
+    v >>= 7;
+  }
+  p[n++] = (uint8_t)v;
+  return n;
+}
+
+static inline uint32_t varint_size(uint64_t v) {
+  uint32_t n = 1;
+  while (v >= 0x80) {
+    v >>= 7;
+    n++;
+  }
+  return n;
+}
+
+static inline bool get_varint(const uint8_t*& p, const uint8_t* end, uint64_t* v) {
+  uint64_t x = 0;
+  for (uint32_t shift = 0; shift < 64 && p < end; shift += 7) {
+    uint8_t b = *p++;
+    x |= (uint64_t)(b & 0x7f) << shift;
+    if (b < 0x80) {
+      *v = x;
+      return true;
+    }
+  }
+  return false;
+}
+
+//small differences of either sign to small unsigned numbers
+static inline uint64_t zigzag(uint64_t d) {
+  return (d << 1) ^ (uint64_t)((int64_t)d >> 63);
+}
+
+static inline uint64_t unzigzag(uint64_t z) {
+  return (z >> 1) ^ (0 - (z & 1));
+}
+
+//decode the records of a CHECKPT_FORMAT_VARINT block, calling
+//record(node, degree, continued) for each and neighbor(node, other) for
+//every neighbor it holds. return false if the block is corrupt
+template <typename RecordFn, typename NeighborFn>
+static bool decode_checkpt_records(const checkpt_block_t& cb, RecordFn record, NeighborFn neighbor) {
+  const uint8_t* p = cb.data;
+  const uint8_t* end = cb.data + std::min<size_t>(cb.data_size, sizeof(cb.data));
+  uint64_t node = 0;
+  for (uint32_t r = 0; r < cb.entry_cnt; ++r) {
+    uint64_t delta, degree, count;
+    if (!get_varint(p, end, &delta) || !get_varint(p, end, &degree) || !get_varint(p, end, &count)) {
+      return false;
+    }
+    node += delta;
+    record(node, (uint32_t)degree, (count & 1) != 0);
+    uint64_t other = node;
+    for (uint64_t i = 0; i < count >> 1; ++i) {
+      uint64_t code;
+      if (!get_varint(p, end, &code)) {
+        return false;
+      }
+      other = i == 0 ? node + unzigzag(code) : other + code;
+      neighbor(node, other);
+    }
+  }
+  return true;
+}
+
+//upper bound of the blocks records with neighbors neighbors in total take.
+//a full block leaves less than a header and a neighbor unused and starts
+//with at most one record continued from the previous block
+static uint64_t varint_checkpt_blocks(uint64_t records, uint64_t neighbors) {
+  uint64_t bytes = records * CHECKPT_HEADER_MAX + neighbors * CHECKPT_VARINT_MAX;
+  return bytes / (sizeof(checkpt_block_t::data) - 2 * CHECKPT_HEADER_MAX - CHECKPT_VARINT_MAX) + 1;
+}
+
+//bytes a LOG_FORMAT_VARINT entry takes at most
+static const uint32_t LOG_ENTRY_MAX = 1 + 2 * CHECKPT_VARINT_MAX;
+
+uint32_t log_block_t::capacity(uint32_t format) {
+  if (format != LOG_FORMAT_VARINT) {
+    return 170;
+  }
+  return (sizeof(log_block_t::data) - LOG_ENTRY_MAX) / LOG_ENTRY_MAX + 1;
+}
+
+uint32_t log_block_t::room(const log_cursor_t& cursor) const {
+  if (format != LOG_FORMAT_VARINT) {
+    return 170 - entry_cnt;
+  }
+  if (cursor.bytes + LOG_ENTRY_MAX > sizeof(data)) {
+    return 0;
+  }
+  return (sizeof(data) - LOG_ENTRY_MAX - cursor.bytes) / LOG_ENTRY_MAX + 1;
+}
+
+uint32_t log_block_t::used_bytes(const log_cursor_t& cursor) const {
+  if (format != LOG_FORMAT_VARINT) {
+    return entry_cnt * sizeof(log_entry_t);
+  }
+  return cursor.bytes;
+}
+
+void log_block_t::append(const log_entry_t& entry, log_cursor_t* cursor) {
+  if (format != LOG_FORMAT_VARINT) {
+    log_entry[entry_cnt++] = entry;
+    return;
+  }
+  uint8_t* p = data + cursor->bytes;
+  bool same = entry_cnt > 0 && entry.node1 == cursor->node1;
+  *p++ = (uint8_t)(entry.opcode | (entry.node2 != 0 ? 0x40 : 0) | (same ? 0x80 : 0));
+  if (!same) {
+    p += put_varint(p, entry.node1);
+  }
+  if (entry.node2 != 0) {
+    p += put_varint(p, entry.node2);
+  }
+  cursor->bytes = (uint32_t)(p - data);
+  cursor->node1 = entry.node1;
+  entry_cnt++;
+}
+
+bool log_block_t::decode(std::vector<log_entry_t>* out, log_cursor_t* cursor) const {
+  *cursor = log_cursor_t();
+  if (format != LOG_FORMAT_VARINT) {
+    if (entry_cnt > 170) {
+      return false;
+    }
+    if (out != nullptr) {
+      out->insert(out->end(), log_entry, log_entry + entry_cnt);
+    }
+    return true;
+  }
+  const uint8_t* p = data;
+  const uint8_t* end = data + sizeof(data);
+  for (uint32_t i = 0; i < entry_cnt; ++i) {
+    if (p == end) {
+      return false;
+    }
+    uint8_t op = *p++;
+    log_entry_t entry(op & 0x3f, cursor->node1, 0);
+    if (!(op & 0x80) && !get_varint(p, end, &entry.node1)) {
+      return false;
+    }
+    if ((op & 0x40) && !get_varint(p, end, &entry.node2)) {
+      return false;
+    }
+    if (out != nullptr) {
+      out->push_back(entry);
+    }
+    cursor->node1 = entry.node1;
+  }
+  cursor->bytes = (uint32_t)(p - data);
+  return true;
+}
+
+uint64_t log_block_t::compute_checksum(const log_cursor_t& cursor) const {
+  return compute_prefix_checksum((const void*)this, offsetof(log_block_t, data) + used_bytes(cursor), checksum_type);
+}
+
+bool log_block_t::verify() const {
+  log_cursor_t cursor;
+  if (!decode(nullptr, &cursor)) {
+    return false;
+  }
+  //blocks written before the checksum stopped at the entries have one over
+  //the whole block
+  return checksum == compute_checksum(cursor)
+      || checksum == compute_block_checksum((void*)this, checksum_type);
+}
+
 void server_log::bind_graph(struct Graph* g) {
   graph = g;
 }
 
+void server_log::set_log_io(int io) {
+  log_io = io;
+}
+
+void server_log::set_storage(int type) {
+  storage_type = type;
+}
+
 void server_log::attach_log(const string& devfile) {
-  log = devfile.c_str();
-  fd = open(log, O_RDWR);
-  if (fd < 0) {
-    print_debug("Open log disk failed.");
+  log_storage* s;
+  if (storage_type == STORAGE_SEGMENTS) {
+    s = new segment_storage();
+  }else if (storage_type == STORAGE_MEMORY) {
+    s = new memory_storage();
+  }else {
+    s = new device_storage(log_io);
+  }
+  //a storage that failed to open reads as empty
+  s->open(devfile);
+  if (storage_type == STORAGE_DEVICE) {
+    log_io = ((device_storage*)s)->io_mode();
   }
+  attach_storage(s);
+}
+
+void server_log::attach_storage(log_storage* s) {
+  storage = s;
+  device_blocks = s->size_blocks();
+  submit_writes = s->async_writes() || s->write_granularity() < BLOCK_SIZE;
+  if (s->async_writes()) {
+    reaper = std::thread(&server_log::run_reaper, this);
+  }
+}
+
+void server_log::read_block(void* buf, uint32_t offset) {
+  storage->read_blocks(buf, offset, 1);
+}
+
+void server_log::read_blocks(void* buf, uint32_t offset, uint32_t n) {
+  storage->read_blocks(buf, offset, n);
+}
+
+void server_log::prefetch_blocks(uint32_t offset, uint32_t n) {
+  storage->prefetch_blocks(offset, n);
+}
+
+int server_log::write_block(const void* buf, uint32_t offset) {
+  bytes_written += BLOCK_SIZE;
+  return storage->write_block(buf, offset);
 }
 
 void server_log::init_server_log() {
-  print_debug("Init server log.");
+  debug_info("Init server log.");
   read_in_superblock(&super_block);
   if (super_block.checksum != super_block.compute_checksum()) {
     //the super block is not initialized
@@ -36,197 +281,750 @@ void server_log::init_server_log() {
 }
 
 void server_log::init_superblock() {
-  print_debug("Init super block.");
+  debug_info("Init super block.");
   super_block.clear();
   super_block.log_start = 1;
-  super_block.log_size = LOG_SEG_SIZE;
-  super_block.checksum = super_block.compute_checksum();
+  super_block.log_size = storage->log_size();
   block_offset = 1;
-  write_super_block(&super_block);
+  block_generation = 0;
+  new_cur_block();
+  sync_super_block();
 }
 
 void server_log::format() {
-  print_debug("Format system.");
+  debug_info("Format system.");
   read_in_superblock(&super_block);
   if (super_block.checksum != super_block.compute_checksum()) {
     init_superblock();
     return;
   }
-  int old_generation_num = super_block.generation_num;
+  //blocks of later laps carry generations up to max_generation
+  uint32_t old_generation_num = std::max(super_block.generation_num, super_block.max_generation);
   super_block.clear();
   super_block.generation_num = old_generation_num + 1;
+  super_block.max_generation = super_block.generation_num;
   super_block.log_start = 1;
-  super_block.log_size = LOG_SEG_SIZE;
-  super_block.checksum = super_block.compute_checksum();
+  super_block.log_size = storage->log_size();
   block_offset = 1;
-  write_super_block(&super_block);
+  block_generation = super_block.generation_num;
+  new_cur_block();
+  sync_super_block();
+  //the old log is gone with its generation
+  storage->release_blocks(1, super_block.log_size - 1);
 }
 
 void server_log::read_in_superblock(super_block_t* sb) {
-  void* addr = mmap(NULL, BLOCK_SIZE, PROT_WRITE, MAP_SHARED, fd, 0);
-  memcpy((void*)sb, addr, BLOCK_SIZE);
-  munmap(addr, BLOCK_SIZE);
+  read_block((void*)sb, 0);
 }
 
 void server_log::read_in_log_block(log_block_t* lb, uint32_t offset) {
-  void* addr = mmap(NULL, BLOCK_SIZE, PROT_WRITE, MAP_SHARED, fd, offset * BLOCK_SIZE);
-  memcpy((void*)lb, addr, BLOCK_SIZE);
-  munmap(addr, BLOCK_SIZE);
+  read_block((void*)lb, offset);
 }
 
 void server_log::read_in_checkpt_block(checkpt_block_t* cb, uint32_t offset) {
-  void* addr = mmap(NULL, BLOCK_SIZE, PROT_WRITE, MAP_SHARED, fd, offset * BLOCK_SIZE);
-  memcpy((void*)cb, addr, BLOCK_SIZE);
-  munmap(addr, BLOCK_SIZE);
+  read_block((void*)cb, offset);
 }
 
-void server_log::write_super_block(super_block_t* sb) {
-  void* addr = mmap(NULL, BLOCK_SIZE, PROT_WRITE, MAP_SHARED, fd, 0);
-  memcpy(addr, (void*)sb, BLOCK_SIZE);
-  msync(addr, BLOCK_SIZE, MS_SYNC);
-  munmap(addr, BLOCK_SIZE);
+int server_log::write_super_block(super_block_t* sb) {
+  return write_block((void*)sb, 0);
 }
 
-void server_log::write_log_block(log_block_t* lb, uint32_t offset) {
-  void* addr = mmap(NULL, BLOCK_SIZE, PROT_WRITE, MAP_SHARED, fd, offset * BLOCK_SIZE);
-  memcpy(addr, (void*)lb, BLOCK_SIZE);
-  msync(addr, BLOCK_SIZE, MS_SYNC);
-  munmap(addr, BLOCK_SIZE);
+int server_log::write_log_block(log_block_t* lb, uint32_t offset) {
+  return write_block((void*)lb, offset);
 }
 
-void server_log::write_checkpt_block(checkpt_block_t* cb, uint32_t offset) {
-  void* addr = mmap(NULL, BLOCK_SIZE, PROT_WRITE, MAP_SHARED, fd, offset * BLOCK_SIZE);
-  memcpy(addr, (void*)cb, BLOCK_SIZE);
-  msync(addr, BLOCK_SIZE, MS_SYNC);
-  munmap(addr, BLOCK_SIZE);
+int server_log::write_checkpt_block(checkpt_block_t* cb, uint32_t offset) {
+  return write_block((void*)cb, offset);
 }
 
-void server_log::add_log_entry(uint32_t opcode, uint64_t node1, uint64_t node2) {
-  char buf[100];
+uint64_t server_log::add_log_entry(uint32_t opcode, uint64_t node1, uint64_t node2) {
   switch (opcode) {
     case OP_ADD_NODE:
-      sprintf(buf, "Add log entry: Add node %" PRIu64 ".", node1);
-      print_debug(buf);
+      debug_trace("Add log entry: Add node %" PRIu64 ".", node1);
       break;
     case OP_ADD_EDGE:
-      sprintf(buf, "Add log entry: Add edge <%" PRIu64 ",%" PRIu64 ">.", node1, node2);
-      print_debug(buf);
+      debug_trace("Add log entry: Add edge <%" PRIu64 ",%" PRIu64 ">.", node1, node2);
       break;
     case OP_REMOVE_NODE:
-      sprintf(buf, "Add log entry: Remove node %" PRIu64 ".", node1);
-      print_debug(buf);
+      debug_trace("Add log entry: Remove node %" PRIu64 ".", node1);
       break;
     case OP_REMOVE_EDGE:
-      sprintf(buf, "Add log entry: Remove edge <%" PRIu64 ",%" PRIu64 ">.", node1, node2);
-      print_debug(buf);
+      debug_trace("Add log entry: Remove edge <%" PRIu64 ",%" PRIu64 ">.", node1, node2);
       break;
     default:
       break;
   }
-    
-  if (cur_block.entry_cnt == 170) {
+
+  std::unique_lock<std::mutex> lk(log_mutex);
+  append_locked(log_entry_t(opcode, node1, node2));
+  if (group_commit_delay_us == 0 || cur_block.room(block_cursor) == 0) {
+    write_cur_block_locked(lk);
+  }
+  return appended_lsn;
+}
+
+uint64_t server_log::add_log_entries(const std::vector<log_entry_t>& entries) {
+  std::unique_lock<std::mutex> lk(log_mutex);
+  for (const log_entry_t& entry : entries) {
+    append_locked(entry);
+    if (cur_block.room(block_cursor) == 0) {
+      write_cur_block_locked(lk);
+    }
+  }
+  if (group_commit_delay_us == 0 && submitted_lsn != appended_lsn) {
+    write_cur_block_locked(lk);
+  }
+  return appended_lsn;
+}
+
+void server_log::append_locked(const log_entry_t& entry) {
+  if (cur_block.room(block_cursor) == 0) {
     //current log block is full
-    block_offset++;
-    cur_block.clear();
+    next_block_locked();
+    new_cur_block();
   }
-  cur_block.generation_num = super_block.generation_num;
-  log_entry_t new_log_entry(opcode, node1, node2);
-  cur_block.log_entry[cur_block.entry_cnt++] = new_log_entry;
-  cur_block.checksum = cur_block.compute_checksum();
-  write_log_block(&cur_block, block_offset);
+  cur_block.generation_num = block_generation;
+  cur_block.append(entry, &block_cursor);
+  appended_lsn++;
+}
+
+void server_log::new_cur_block() {
+  cur_block.clear();
+  cur_block.format = log_format;
+  cur_block.checksum_type = checksum_type;
+  block_cursor = log_cursor_t();
+  block_written = 0;
+}
+
+void server_log::sync_super_block() {
+  super_block.checksum_type = checksum_type;
+  super_block.checksum = super_block.compute_checksum();
+  int res = write_super_block(&super_block);
+  if (res < 0) {
+    debug_error("Write super block failed: %s.", strerror(-res));
+  }
+}
+
+void server_log::set_checksum_type(uint32_t type) {
+  checksum_type = type == CHECKSUM_XOR ? CHECKSUM_XOR : CHECKSUM_CRC32C;
+}
+
+void server_log::set_log_format(uint32_t format) {
+  log_format = format == LOG_FORMAT_FIXED ? LOG_FORMAT_FIXED : LOG_FORMAT_VARINT;
+}
+
+void server_log::next_block_locked() {
+  block_offset++;
+  if (block_offset < super_block.log_size) {
+    return;
+  }
+  //wrap around, the next lap overwrites the blocks truncated by checkpoints
+  block_offset = 1;
+  block_generation++;
+  if (block_generation > super_block.max_generation) {
+    super_block.max_generation = block_generation;
+    sync_super_block();
+  }
+}
+
+void server_log::write_cur_block_locked(std::unique_lock<std::mutex>& lk) {
+  if (submit_writes) {
+    //the reaper marks the entries durable once the write completed
+    submit_cur_block_locked(lk);
+    return;
+  }
+  //write through, a full block is never rewritten so it's flushed right away.
+  //wait for a running flush of this block so it can't land after ours
+  while (flushing) {
+    log_cv.wait(lk);
+  }
+  cur_block.checksum = cur_block.compute_checksum(block_cursor);
+  int res = write_log_block(&cur_block, block_offset);
+  submitted_lsn = appended_lsn;
+  complete_write_locked(block_offset, appended_lsn, res);
+}
+
+void server_log::submit_cur_block_locked(std::unique_lock<std::mutex>& lk) {
+  while (direct_writes.size() >= DIRECT_QUEUE_DEPTH) {
+    log_cv.wait(lk);
+  }
+  cur_block.checksum = cur_block.compute_checksum(block_cursor);
+  uint32_t from[2];
+  uint32_t to[2];
+  uint32_t n = dirty_ranges_locked(from, to);
+  if (storage->async_writes()) {
+    void* buf = nullptr;
+    if (!direct_buffers.empty()) {
+      buf = direct_buffers.back();
+      direct_buffers.pop_back();
+    }else if (posix_memalign(&buf, BLOCK_SIZE, BLOCK_SIZE) != 0) {
+      buf = nullptr;
+    }
+    direct_write_t w = {appended_lsn, block_offset, buf, 0, {0, 0}};
+    if (buf != nullptr) {
+      memcpy(buf, &cur_block, BLOCK_SIZE);
+      //an earlier write of this block must not land after ours, and the
+      //header sector goes after the entries it commits
+      bool barrier = !direct_writes.empty() && direct_writes.back().offset == block_offset;
+      uint64_t tag = direct_tag + direct_writes.size();
+      for (uint32_t k = 0; k < n && w.pending == k; ++k) {
+        w.len[k] = to[k] - from[k];
+        if (storage->submit_write(buf, block_offset, from[k], to[k], tag * 2 + k, barrier || k > 0)) {
+          w.pending++;
+          bytes_written += to[k] - from[k];
+        }
+      }
+      if (w.pending > 0) {
+        direct_writes.push_back(w);
+      }else {
+        direct_buffers.push_back(buf);
+      }
+    }
+    if (buf != nullptr && w.pending == n) {
+      submitted_lsn = appended_lsn;
+      return;
+    }
+    //out of memory or a broken queue: let the writes in flight land and
+    //rewrite the whole block
+    debug_warn("Queue log block write failed. Write it synchronously.");
+    while (!direct_writes.empty()) {
+      log_cv.wait(lk);
+    }
+    n = 1;
+    from[0] = 0;
+    to[0] = BLOCK_SIZE;
+  }
+  //no asynchronous writes, write while holding log_mutex
+  int res = storage->write_ranges(&cur_block, block_offset, n, from, to);
+  for (uint32_t k = 0; k < n; ++k) {
+    bytes_written += to[k] - from[k];
+  }
+  submitted_lsn = appended_lsn;
+  complete_write_locked(block_offset, appended_lsn, res);
+}
+
+void server_log::complete_write_locked(uint32_t offset, uint64_t lsn, int res) {
+  if (res < 0) {
+    debug_error("Write log block %u failed: %s.", offset, strerror(-res));
+    if (write_error == 0) {
+      write_error = -res;
+    }
+  }
+  if (write_error == 0 && lsn > durable_lsn) {
+    durable_lsn = lsn;
+  }
+  log_cv.notify_all();
+}
+
+uint32_t server_log::dirty_ranges_locked(uint32_t* from, uint32_t* to) {
+  uint32_t end = offsetof(log_block_t, data) + cur_block.used_bytes(block_cursor);
+  uint32_t written = block_written;
+  uint32_t sector = storage->write_granularity();
+  block_written = end;
+  from[0] = 0;
+  to[0] = BLOCK_SIZE;
+  if (written == 0 || sector >= BLOCK_SIZE) {
+    return 1;
+  }
+  //the header sector always changes, the sector written ends in may have
+  //got more entries since
+  uint32_t first = std::max(written / sector * sector, sector);
+  uint32_t last = (end + sector - 1) / sector * sector;
+  if (last <= first) {
+    to[0] = sector;
+    return 1;
+  }
+  from[0] = first;
+  to[0] = last;
+  from[1] = 0;
+  to[1] = sector;
+  return 2;
+}
+
+void server_log::run_reaper() {
+  uint64_t tag;
+  int32_t res;
+  while (storage->wait_write(&tag, &res) && tag != REAPER_STOP) {
+    std::function<void()> cb;
+    {
+      std::lock_guard<std::mutex> lk(log_mutex);
+      direct_write_t& w = direct_writes[tag / 2 - direct_tag];
+      bool failed = res != (int32_t)w.len[tag % 2];
+      if (failed) {
+        //rewriting it could land after a later write of the same block, so
+        //the log keeps the hole and nothing after it becomes durable
+        debug_error("Write log block %u failed: %s.", w.offset, res < 0 ? strerror(-res) : "short write");
+        if (write_error == 0) {
+          write_error = res < 0 ? -res : EIO;
+        }
+      }
+      w.pending--;
+      uint64_t durable = durable_lsn;
+      //writes complete in any order, an entry is durable once every write
+      //started before it completed
+      while (!direct_writes.empty() && direct_writes.front().pending == 0) {
+        if (write_error == 0) {
+          durable_lsn = std::max(durable_lsn, direct_writes.front().lsn);
+        }
+        direct_buffers.push_back(direct_writes.front().buf);
+        direct_writes.pop_front();
+        direct_tag++;
+      }
+      if (durable_lsn != durable || failed) {
+        cb = durable_callback;
+      }
+      log_cv.notify_all();
+    }
+    if (cb) {
+      cb();
+    }
+  }
+}
+
+void server_log::set_group_commit_delay(uint32_t delay_us) {
+  group_commit_delay_us = delay_us;
+}
+
+uint32_t server_log::get_group_commit_delay() {
+  return group_commit_delay_us;
+}
+
+void server_log::flush_locked(std::unique_lock<std::mutex>& lk) {
+  if (submit_writes) {
+    uint64_t lsn = appended_lsn;
+    if (submitted_lsn < lsn) {
+      submit_cur_block_locked(lk);
+    }
+    log_cv.wait(lk, [this, lsn]() { return durable_lsn >= lsn || write_error != 0; });
+    return;
+  }
+  while (flushing) {
+    log_cv.wait(lk);
+  }
+  if (durable_lsn == appended_lsn) {
+    return;
+  }
+  //write a copy so appenders can keep filling cur_block during the sync
+  cur_block.checksum = cur_block.compute_checksum(block_cursor);
+  log_block_t lb = cur_block;
+  uint32_t offset = block_offset;
+  uint64_t lsn = appended_lsn;
+  submitted_lsn = lsn;
+  flushing = true;
+  lk.unlock();
+  int res = write_log_block(&lb, offset);
+  lk.lock();
+  flushing = false;
+  complete_write_locked(offset, lsn, res);
+}
+
+void server_log::flush_log() {
+  std::unique_lock<std::mutex> lk(log_mutex);
+  flush_locked(lk);
+}
+
+void server_log::start_flush_log() {
+  std::unique_lock<std::mutex> lk(log_mutex);
+  if (!submit_writes) {
+    flush_locked(lk);
+    return;
+  }
+  if (submitted_lsn < appended_lsn) {
+    submit_cur_block_locked(lk);
+  }
+}
+
+void server_log::set_durable_callback(std::function<void()> cb) {
+  std::lock_guard<std::mutex> lk(log_mutex);
+  durable_callback = cb;
+}
+
+uint64_t server_log::get_bytes_written() {
+  return bytes_written.load();
+}
+
+bool server_log::wait_durable(uint64_t lsn) {
+  std::unique_lock<std::mutex> lk(log_mutex);
+  while (durable_lsn < lsn && write_error == 0) {
+    if (flush_leader) {
+      log_cv.wait(lk);
+      continue;
+    }
+    //become the leader, give other writers up to the delay to join the batch
+    flush_leader = true;
+    log_cv.wait_for(lk, std::chrono::microseconds(group_commit_delay_us),
+        [this, lsn]() { return durable_lsn >= lsn || write_error != 0; });
+    flush_locked(lk);
+    flush_leader = false;
+    log_cv.notify_all();
+  }
+  return durable_lsn >= lsn;
+}
+
+uint64_t server_log::get_durable_lsn() {
+  std::lock_guard<std::mutex> lk(log_mutex);
+  return durable_lsn;
+}
+
+int server_log::get_write_error() {
+  std::lock_guard<std::mutex> lk(log_mutex);
+  return write_error;
+}
+
+uint64_t server_log::get_appended_lsn() {
+  std::lock_guard<std::mutex> lk(log_mutex);
+  return appended_lsn;
 }
 
 void server_log::recover_status() {
-  print_debug("Recovering status.");
+  debug_info("Recovering status.");
   recover_from_checkpoint();
   play_log();
 }
 
 void server_log::recover_from_checkpoint() {
-  print_debug("Recovering from checkpoint.");
+  debug_info("Recovering from checkpoint.");
   if (super_block.checkpoint_size == 0) {
     //no checkpoint
-    print_debug("No checkpoint detected. Skip.");
+    debug_info("No checkpoint detected. Skip.");
     return;
   }
-  print_debug("Reading checkpoint.");
-  char buf[100];
-  for (uint32_t i = 0; i < super_block.checkpoint_size; ++i) {
-    read_in_checkpt_block(&checkpt_block, super_block.log_size + i);
+  debug_info("Reading checkpoint.");
+  //the base image, then the deltas in the order they were taken
+  uint32_t start = super_block.checkpoint_start == 0 ? super_block.log_size : super_block.checkpoint_start;
+  load_base_checkpoint(start, super_block.checkpoint_size);
+  start += super_block.checkpoint_size;
+  bool varint = image_format() == CHECKPT_FORMAT_VARINT;
+  for (uint32_t i = 0; i < super_block.delta_size; ++i) {
+    read_in_checkpt_block(&checkpt_block, start + i);
+    if (varint) {
+      uint32_t kind = checkpt_block.kind;
+      neighbor_set_t* set = nullptr;
+      bool ok = decode_checkpt_records(checkpt_block, [&](uint64_t node, uint32_t degree, bool continued) {
+        if (kind == CHECKPT_TOMBSTONE) {
+          graph->g.erase(node);
+          set = nullptr;
+          return;
+        }
+        set = &graph->g[node];
+        if (!continued) {
+          //a delta replaces the neighbors of the node
+          *set = neighbor_set_t();
+          set->reserve(degree);
+        }
+      }, [&](uint64_t node, uint64_t other) {
+        if (set != nullptr) {
+          set->insert(other);
+        }
+      });
+      if (!ok) {
+        debug_error("Corrupt checkpoint block.");
+      }
+      continue;
+    }
     for (uint32_t k = 0; k < checkpt_block.entry_cnt; ++k) {
       uint64_t node1 = checkpt_block.edges[k].node1;
       uint64_t node2 = checkpt_block.edges[k].node2;
-      if (node1 == node2) {
-        //this is a node info
-        sprintf(buf, "Reading checkpoint. Add node %" PRIu64 ".", node1);
-        print_debug(buf);
-        graph->g[node1] = unordered_set<uint64_t>();
+      if (checkpt_block.kind == CHECKPT_TOMBSTONE) {
+        graph->g.erase(node1);
+      }else if (node1 == node2) {
+        //a delta replaces the neighbors of the node
+        graph->g[node1] = neighbor_set_t();
       }else {
-        //add edge from node1 to node2
-        sprintf(buf, "Reading checkpoint. Add edge <%" PRIu64 ",%" PRIu64 ">.", node1, node2);
-        print_debug(buf);
         graph->g[node1].insert(node2);
-        graph->g[node2].insert(node1);
       }
     }
   }
 }
 
+uint32_t server_log::image_format() {
+  return super_block.checkpoint_format == 0 ? CHECKPT_FORMAT_PAIRS : super_block.checkpoint_format;
+}
+
+void server_log::load_base_checkpoint(uint32_t start, uint32_t blocks) {
+  bool varint = image_format() == CHECKPT_FORMAT_VARINT;
+  std::vector<checkpt_block_t> chunk(LOG_READAHEAD_BLOCKS);
+  //<node, degree> of every node, the pairs format stores no degrees and
+  //all its nodes come first, collect them up to the block holding the first edge
+  std::vector<std::pair<uint64_t, uint32_t> > nodes;
+  uint32_t edge_block = varint ? 0 : blocks;
+  for (uint32_t i = 0; i < blocks && (varint || edge_block == blocks); i += LOG_READAHEAD_BLOCKS) {
+    uint32_t n = std::min<uint32_t>(LOG_READAHEAD_BLOCKS, blocks - i);
+    read_blocks(chunk.data(), start + i, n);
+    for (uint32_t k = 0; k < n && varint; ++k) {
+      bool ok = decode_checkpt_records(chunk[k], [&](uint64_t node, uint32_t degree, bool continued) {
+        if (!continued) {
+          nodes.push_back(std::make_pair(node, degree));
+        }
+      }, [](uint64_t node, uint64_t other) {});
+      if (!ok) {
+        debug_error("Corrupt checkpoint block.");
+      }
+    }
+    for (uint32_t k = 0; k < n && edge_block == blocks; ++k) {
+      for (uint32_t e = 0; e < chunk[k].entry_cnt; ++e) {
+        if (chunk[k].edges[e].node1 != chunk[k].edges[e].node2) {
+          edge_block = i + k;
+          break;
+        }
+        nodes.push_back(std::make_pair(chunk[k].edges[e].node1, 0));
+      }
+    }
+  }
+  graph->g.reserve(graph->g.size() + nodes.size());
+  for (std::pair<uint64_t, uint32_t>& n : nodes) {
+    neighbor_set_t& set = graph->g[n.first];
+    if (n.second > 0) {
+      set.reserve(n.second);
+    }
+  }
+  debug_info("Reading checkpoint. %zu nodes.", nodes.size());
+  std::vector<std::pair<uint64_t, uint32_t> >().swap(nodes);
+
+#if COMPACT_ADJACENCY
+  if (!varint) {
+    //count the degrees to allocate every neighbor array once
+    std::vector<uint32_t> degree(graph->g.size(), 0);
+    for_each_base_edge(chunk, start, edge_block, blocks, [&](adjacency_t::iterator it, uint64_t other) {
+      degree[it - graph->g.begin()]++;
+    });
+    uint32_t threads = recovery_threads;
+    run_threads(threads, [&](uint32_t t) {
+      for (size_t i = t; i < degree.size(); i += threads) {
+        (graph->g.begin() + i)->second.reserve(degree[i]);
+      }
+    });
+  }
+#endif
+  for_each_base_edge(chunk, start, edge_block, blocks, [&](adjacency_t::iterator it, uint64_t other) {
+    it->second.insert(other);
+  });
+}
+
+void server_log::for_each_base_edge(std::vector<checkpt_block_t>& chunk, uint32_t start, uint32_t from,
+    uint32_t blocks, const std::function<void(adjacency_t::iterator, uint64_t)>& fn) {
+  bool varint = image_format() == CHECKPT_FORMAT_VARINT;
+  uint32_t threads = recovery_threads;
+  //edges are written grouped by their first node, remember its lookup
+  std::vector<std::pair<uint64_t, adjacency_t::iterator> > last(threads, std::make_pair(0, graph->g.end()));
+  for (uint32_t i = from; i < blocks; i += LOG_READAHEAD_BLOCKS) {
+    uint32_t n = std::min<uint32_t>(LOG_READAHEAD_BLOCKS, blocks - i);
+    read_blocks(chunk.data(), start + i, n);
+    if (i + n < blocks) {
+      prefetch_blocks(start + i + n, std::min<uint32_t>(LOG_READAHEAD_BLOCKS, blocks - i - n));
+    }
+    //every thread goes through the whole chunk and takes the ends it owns
+    run_threads(threads, [&](uint32_t t) {
+      adjacency_t::iterator end = graph->g.end();
+      auto edge = [&](uint64_t n1, uint64_t n2) {
+        if (adj_hash(n1) % threads == t) {
+          if (last[t].second == end || last[t].first != n1) {
+            last[t] = std::make_pair(n1, graph->g.find(n1));
+          }
+          if (last[t].second != end) {
+            fn(last[t].second, n2);
+          }
+        }
+        if (adj_hash(n2) % threads == t) {
+          adjacency_t::iterator it = graph->g.find(n2);
+          if (it != end) {
+            fn(it, n1);
+          }
+        }
+      };
+      for (uint32_t k = 0; k < n; ++k) {
+        const checkpt_block_t& cb = chunk[k];
+        if (varint) {
+          decode_checkpt_records(cb, [](uint64_t node, uint32_t degree, bool continued) {}, edge);
+          continue;
+        }
+        for (uint32_t e = 0; e < cb.entry_cnt; ++e) {
+          if (cb.edges[e].node1 != cb.edges[e].node2) {
+            edge(cb.edges[e].node1, cb.edges[e].node2);
+          }
+        }
+      }
+    });
+  }
+}
+
+void server_log::set_recovery_threads(uint32_t threads) {
+  recovery_threads = threads == 0 ? 1 : threads;
+}
+
 void server_log::play_log() {
-  print_debug("Playing log.");
+  debug_info("Playing log.");
   uint32_t log_start = super_block.log_start;
   uint32_t log_size = super_block.log_size;
-  log_block_t lb;
+  uint32_t generation = super_block.generation_num;
+  block_offset = log_start;
+  block_generation = generation;
+  new_cur_block();
+  std::vector<log_block_t> chunk(LOG_READAHEAD_BLOCKS);
+  std::vector<log_entry_t> entries;
+  std::vector<log_entry_t> block_entries;
   uint32_t i = log_start;
-  uint32_t lastsize = 0;
-  for (; i < log_size; ++i) {
-    read_in_log_block(&lb, i);
-    //check checksum and generation number
-    if (lb.checksum == lb.compute_checksum()
-        && lb.generation_num == super_block.generation_num) {
-      //this log block is valid
-      lastsize = lb.entry_cnt;
-      for (uint32_t k = 0; k < lb.entry_cnt; ++k) {
-        execute_log_entry(&lb.log_entry[k]);
+  bool end = false;
+  while (!end) {
+    //a chunk stops at the end of the ring and, after a wrap, at log_start
+    uint32_t n = std::min<uint32_t>(LOG_READAHEAD_BLOCKS, (i < log_start ? log_start : log_size) - i);
+    read_blocks(chunk.data(), i, n);
+    uint32_t next = i + n == log_size ? 1 : i + n;
+    prefetch_blocks(next, std::min<uint32_t>(LOG_READAHEAD_BLOCKS, log_size - next));
+    //check checksum and generation number of this lap,
+    //the first invalid block is the end of the log
+    uint32_t valid = count_valid_blocks(chunk.data(), n, generation);
+    end = valid < n;
+    entries.clear();
+    for (uint32_t k = 0; k < valid; ++k) {
+      log_block_t& lb = chunk[k];
+      log_cursor_t cursor;
+      block_entries.clear();
+      if (!lb.decode(&block_entries, &cursor)) {
+        debug_error("Corrupt log block.");
+        end = true;
+        break;
+      }
+      //the checkpoint already holds the entries before
+      //log_start_entry of the first block
+      uint32_t first = i + k == log_start && generation == super_block.generation_num ? super_block.log_start_entry : 0;
+      if (first < block_entries.size()) {
+        entries.insert(entries.end(), block_entries.begin() + first, block_entries.end());
+      }
+      //keep appending to the last valid block, append_locked moves on
+      //to the next one once it's full
+      block_offset = i + k;
+      block_generation = generation;
+      cur_block = lb;
+      cur_block.checksum_type = checksum_type;
+      block_cursor = cursor;
+      block_written = offsetof(log_block_t, data) + lb.used_bytes(cursor);
+      if (lb.room(cursor) > 0) {
+        end = true;
+        break;
       }
-    }else {
-      //we've reached at the end of the log
-      break;
     }
+    replay_entries(entries);
+    if (next == 1) {
+      generation++;
+    }
+    i = next;
+    if (i == log_start) {
+      //the ring is full
+      end = true;
+    }
+  }
+}
+
+uint32_t server_log::count_valid_blocks(const log_block_t* blocks, uint32_t n, uint32_t generation) {
+  uint32_t threads = std::min<uint32_t>(recovery_threads, (n + 63) / 64);
+  std::vector<uint32_t> first_invalid(threads, n);
+  auto check = [&](uint32_t t) {
+    uint32_t from = (uint64_t)n * t / threads;
+    uint32_t to = (uint64_t)n * (t + 1) / threads;
+    for (uint32_t k = from; k < to; ++k) {
+      log_block_t* lb = (log_block_t*)&blocks[k];
+      if (lb->generation_num != generation || !lb->verify()) {
+        first_invalid[t] = k;
+        return;
+      }
+    }
+  };
+  if (threads > 0) {
+    run_threads(threads, check);
+  }
+  uint32_t valid = n;
+  for (uint32_t k : first_invalid) {
+    valid = std::min(valid, k);
+  }
+  return valid;
+}
+
+void server_log::replay_entries(const std::vector<log_entry_t>& entries) {
+  size_t begin = 0;
+  while (begin < entries.size()) {
+    //a node removal touches all its neighbors, it is applied on its own
+    size_t end = begin;
+    while (end < entries.size() && entries[end].opcode != OP_REMOVE_NODE) {
+      end++;
+    }
+    replay_run(entries, begin, end);
+    if (end < entries.size()) {
+      log_entry_t entry = entries[end];
+      execute_log_entry(&entry);
+      end++;
+    }
+    begin = end;
   }
-  block_offset = i;
-  if (lastsize < 170 && lastsize > 0) {
-    //last log block still has empty space for log entries
-    block_offset--;
+}
+
+void server_log::replay_run(const std::vector<log_entry_t>& entries, size_t begin, size_t end) {
+  //short runs aren't worth starting threads for
+  uint32_t threads = end - begin < REPLAY_PARALLEL_MIN ? 1 : recovery_threads;
+  //no node is removed in the run, so adding its nodes up front changes no
+  //edge operation and keeps the vertex table fixed while the threads run
+  for (size_t k = begin; k < end; ++k) {
+    if (entries[k].opcode == OP_ADD_NODE) {
+      graph->addNode(entries[k].node1);
+    }
+  }
+  //both ends of an edge are updated by the thread owning them, one
+  //neighbor set is only ever touched by one thread
+  std::vector<std::vector<uint64_t> > touched(threads);
+  auto apply = [&](uint32_t t) {
+    for (size_t k = begin; k < end; ++k) {
+      const log_entry_t& e = entries[k];
+      if ((e.opcode != OP_ADD_EDGE && e.opcode != OP_REMOVE_EDGE) || e.node1 == e.node2) {
+        continue;
+      }
+      for (int side = 0; side < 2; ++side) {
+        uint64_t n = side == 0 ? e.node1 : e.node2;
+        uint64_t other = side == 0 ? e.node2 : e.node1;
+        if (adj_hash(n) % threads != t) {
+          continue;
+        }
+        auto it = graph->g.find(n);
+        if (it == graph->g.end()) {
+          continue;
+        }
+        size_t degree = it->second.size();
+        if (e.opcode == OP_ADD_EDGE) {
+          it->second.insert(other);
+        }else {
+          it->second.erase(other);
+        }
+        if (it->second.size() != degree) {
+          touched[t].push_back(n);
+        }
+      }
+    }
+  };
+  run_threads(threads, apply);
+  for (std::vector<uint64_t>& v : touched) {
+    graph->dirty.insert(v.begin(), v.end());
   }
 }
 
 void server_log::execute_log_entry(log_entry_t* entry) {
-  print_debug("Executing log entry.");
   if (!entry) {
     return;
   }
-  char buf[100];
   //read operation code
   switch (entry->opcode) {
     case OP_ADD_NODE:
-      sprintf(buf, "Executing log entry. Add node %" PRIu64 ".", entry->node1);
-      print_debug(buf);
+      debug_trace("Executing log entry. Add node %" PRIu64 ".", entry->node1);
       graph->addNode(entry->node1);
       break;
     case OP_ADD_EDGE:
-      sprintf(buf, "Executing log entry. Add edge <%" PRIu64 ",%" PRIu64 ">.", entry->node1, entry->node2);
-      print_debug(buf);
+      debug_trace("Executing log entry. Add edge <%" PRIu64 ",%" PRIu64 ">.", entry->node1, entry->node2);
       graph->addEdge(entry->node1, entry->node2);
       break;
     case OP_REMOVE_NODE:
-      sprintf(buf, "Executing log entry. Remove node %" PRIu64 ".", entry->node1);
-      print_debug(buf);
+      debug_trace("Executing log entry. Remove node %" PRIu64 ".", entry->node1);
       graph->removeNode(entry->node1);
       break;
     case OP_REMOVE_EDGE:
-      sprintf(buf, "Executing log entry. Remove edge <%" PRIu64 ",%" PRIu64 ">.", entry->node1, entry->node2);
-      print_debug(buf);
+      debug_trace("Executing log entry. Remove edge <%" PRIu64 ",%" PRIu64 ">.", entry->node1, entry->node2);
       graph->removeEdge(entry->node1, entry->node2);
       break;
     default:
@@ -234,57 +1032,567 @@ void server_log::execute_log_entry(log_entry_t* entry) {
   }
 }
 
-void server_log::add_checkpt_entry(uint64_t node1, uint64_t node2) {
-  print_debug("Adding checkpoint entry.");
-  if (checkpt_block.entry_cnt == 255) {
-    block_offset++;
-    checkpt_block.clear();
+void server_log::add_checkpt_entry(uint32_t kind, uint64_t node1, uint64_t node2) {
+  //a block holds entries of a single kind
+  if (checkpt_block.entry_cnt == 255 || (checkpt_block.entry_cnt > 0 && checkpt_block.kind != kind)) {
+    flush_checkpt_block();
   }
   edge_t new_edge;
   new_edge.node1 = node1;
   new_edge.node2 = node2;
+  checkpt_block.kind = kind;
   checkpt_block.edges[checkpt_block.entry_cnt++] = new_edge;
-  write_checkpt_block(&checkpt_block, block_offset);
 }
 
-void server_log::checkpoint() {
-  print_debug("Creating checkpoint.");
+void server_log::add_checkpt_record(uint32_t kind, uint64_t node, uint32_t degree,
+    const uint64_t* neighbors, uint32_t count) {
+  uint32_t done = 0;
+  do {
+    //a block holds records of a single kind, move on unless a header and
+    //a neighbor still fit
+    if (checkpt_block.entry_cnt > 0 && (checkpt_block.kind != kind
+        || checkpt_block.data_size + CHECKPT_HEADER_MAX + CHECKPT_VARINT_MAX > sizeof(checkpt_block.data))) {
+      flush_checkpt_block();
+    }
+    //encode as many neighbors as fit next to the largest header
+    uint8_t buf[sizeof(checkpt_block.data)];
+    uint32_t room = sizeof(checkpt_block.data) - checkpt_block.data_size - CHECKPT_HEADER_MAX;
+    uint32_t len = 0;
+    uint32_t n = 0;
+    for (uint64_t prev = node; done + n < count; ++n) {
+      uint64_t other = neighbors[done + n];
+      uint64_t code = n == 0 ? zigzag(other - node) : other - prev;
+      if (len + varint_size(code) > room) {
+        break;
+      }
+      len += put_varint(buf + len, code);
+      prev = other;
+    }
+    uint8_t* p = checkpt_block.data + checkpt_block.data_size;
+    p += put_varint(p, checkpt_block.entry_cnt == 0 ? node : node - checkpt_prev_node);
+    p += put_varint(p, degree);
+    p += put_varint(p, (uint64_t)n << 1 | (done > 0 ? 1 : 0));
+    memcpy(p, buf, len);
+    checkpt_block.data_size = (uint32_t)(p + len - checkpt_block.data);
+    checkpt_block.kind = kind;
+    checkpt_block.entry_cnt++;
+    checkpt_prev_node = node;
+    done += n;
+  } while (done < count);
+}
+
+void server_log::flush_checkpt_block() {
+  int res = write_checkpt_block(&checkpt_block, checkpt_offset);
+  if (res < 0 && checkpt_error == 0) {
+    checkpt_error = -res;
+  }
+  checkpt_offset++;
+  checkpt_block.clear();
+}
+
+void server_log::set_checkpoint_compaction(uint32_t percent) {
+  compact_percent = percent;
+}
+
+void server_log::set_checkpoint_format(uint32_t format) {
+  checkpt_format = format == CHECKPT_FORMAT_PAIRS ? CHECKPT_FORMAT_PAIRS : CHECKPT_FORMAT_VARINT;
+}
+
+void server_log::write_base_checkpoint(uint32_t start) {
+  checkpt_offset = start;
+  checkpt_block.clear();
+  if (checkpt_format == CHECKPT_FORMAT_VARINT) {
+    //nodes in ascending order, each with its larger neighbors sorted, so
+    //every edge is stored once and node ids and neighbors become small gaps
+    ckpt_nodes.clear();
+    for (auto& p : graph->g) {
+      ckpt_nodes.push_back(std::make_pair(p.first, &p.second));
+    }
+    std::sort(ckpt_nodes.begin(), ckpt_nodes.end());
+    for (auto& p : ckpt_nodes) {
+      ckpt_neighbors.clear();
+      for (uint64_t n2 : *p.second) {
+        if (n2 > p.first) {
+          ckpt_neighbors.push_back(n2);
+        }
+      }
+      std::sort(ckpt_neighbors.begin(), ckpt_neighbors.end());
+      add_checkpt_record(CHECKPT_BASE, p.first, (uint32_t)p.second->size(),
+          ckpt_neighbors.data(), (uint32_t)ckpt_neighbors.size());
+    }
+    flush_checkpt_block();
+    return;
+  }
   //first we store all the node info to the checkpoint in the form
   //<node, node>
   //second we store all the edges in the graph by traversing
   //all edge pairs and store them in the checkpoint area
   //because graph is an undirected graph, every edge just store once
   //make sure small node id goes before large node id
-  block_offset = super_block.log_size;
   //store all the nodes in a pair <node, node>
   for (auto& p : graph->g) {
     uint64_t n = p.first;
-    add_checkpt_entry(n, n);
+    add_checkpt_entry(CHECKPT_BASE, n, n);
   }
   //store all the edges in the graph
   for (auto& p : graph->g) {
     uint64_t n1 = p.first;
     for (uint64_t n2 : p.second) {
       if (n1 < n2) {
-        add_checkpt_entry(n1, n2);
+        add_checkpt_entry(CHECKPT_BASE, n1, n2);
       }
     }
   }
-  super_block.checkpoint_size = block_offset - super_block.log_size + 1;
-  super_block.generation_num++;
-  super_block.checksum = super_block.compute_checksum();
-  write_super_block(&super_block);
-  block_offset = super_block.log_start;
+  //the last block is written even if empty, a base has at least one block
+  flush_checkpt_block();
+}
+
+void server_log::write_delta_checkpoint(uint32_t start) {
+  checkpt_offset = start;
+  checkpt_block.clear();
+  if (checkpt_format == CHECKPT_FORMAT_VARINT) {
+    ckpt_ids.assign(graph->dirty.begin(), graph->dirty.end());
+    std::sort(ckpt_ids.begin(), ckpt_ids.end());
+    for (uint64_t n : ckpt_ids) {
+      auto it = graph->g.find(n);
+      if (it == graph->g.end()) {
+        continue;
+      }
+      ckpt_neighbors.assign(it->second.begin(), it->second.end());
+      std::sort(ckpt_neighbors.begin(), ckpt_neighbors.end());
+      add_checkpt_record(CHECKPT_DELTA, n, (uint32_t)ckpt_neighbors.size(),
+          ckpt_neighbors.data(), (uint32_t)ckpt_neighbors.size());
+    }
+    for (uint64_t n : ckpt_ids) {
+      if (graph->g.find(n) == graph->g.end()) {
+        add_checkpt_record(CHECKPT_TOMBSTONE, n, 0, nullptr, 0);
+      }
+    }
+    if (checkpt_block.entry_cnt > 0) {
+      flush_checkpt_block();
+    }
+    return;
+  }
+  //every dirty vertex is stored with all its neighbors, the neighbors whose
+  //edge to it changed are dirty as well, so one direction per record is enough
+  for (uint64_t n : graph->dirty) {
+    auto it = graph->g.find(n);
+    if (it == graph->g.end()) {
+      continue;
+    }
+    add_checkpt_entry(CHECKPT_DELTA, n, n);
+    for (uint64_t n2 : it->second) {
+      add_checkpt_entry(CHECKPT_DELTA, n, n2);
+    }
+  }
+  for (uint64_t n : graph->dirty) {
+    if (graph->g.find(n) == graph->g.end()) {
+      add_checkpt_entry(CHECKPT_TOMBSTONE, n, n);
+    }
+  }
+  if (checkpt_block.entry_cnt > 0) {
+    flush_checkpt_block();
+  }
+}
+
+uint64_t server_log::base_checkpoint_blocks() {
+  if (checkpt_format == CHECKPT_FORMAT_VARINT) {
+    uint64_t neighbors = 0;
+    for (auto& p : graph->g) {
+      neighbors += p.second.size();
+    }
+    return varint_checkpt_blocks(graph->g.size(), neighbors / 2);
+  }
+  uint64_t entries = 0;
+  for (auto& p : graph->g) {
+    //the node and, every edge being stored once, half its degree
+    entries += 2 + p.second.size();
+  }
+  entries /= 2;
+  return entries == 0 ? 1 : (entries + 254) / 255;
+}
+
+uint64_t server_log::delta_checkpoint_blocks() {
+  uint64_t entries = 0;
+  uint64_t tombstones = 0;
+  uint64_t records = 0;
+  for (uint64_t n : graph->dirty) {
+    auto it = graph->g.find(n);
+    if (it == graph->g.end()) {
+      tombstones++;
+    }else {
+      records++;
+      entries += 1 + it->second.size();
+    }
+  }
+  if (checkpt_format == CHECKPT_FORMAT_VARINT) {
+    return (records > 0 ? varint_checkpt_blocks(records, entries - records) : 0)
+        + (tombstones > 0 ? varint_checkpt_blocks(tombstones, 0) : 0);
+  }
+  return (entries + 254) / 255 + (tombstones + 254) / 255;
+}
+
+bool server_log::plan_checkpoint_locked() {
+  uint32_t image_start = super_block.checkpoint_start == 0 ? super_block.log_size : super_block.checkpoint_start;
+  uint64_t image_end = (uint64_t)image_start + super_block.checkpoint_size + super_block.delta_size;
+  //compact into a new base image when there is none yet, when the deltas
+  //would outgrow compact_percent of the base or the checkpoint region, and
+  //when the image is in another format than new checkpoints
+  ckpt_full = super_block.checkpoint_size == 0 || compact_percent == 0 || image_format() != checkpt_format;
+  if (!ckpt_full) {
+    uint64_t blocks = delta_checkpoint_blocks();
+    uint64_t delta = super_block.delta_size + blocks;
+    ckpt_full = delta * 100 > (uint64_t)super_block.checkpoint_size * compact_percent
+        || (device_blocks > 0 && image_end + blocks > device_blocks);
+    ckpt_start = (uint32_t)image_end;
+    ckpt_blocks = (uint32_t)blocks;
+  }
+  if (ckpt_full) {
+    //never overwrite the image the super block points to: the new base goes
+    //before it or after its deltas, whichever has room
+    uint64_t blocks = base_checkpoint_blocks();
+    ckpt_blocks = (uint32_t)blocks;
+    if (super_block.checkpoint_size == 0 || super_block.log_size + blocks <= image_start) {
+      ckpt_start = super_block.log_size;
+    }else if (device_blocks == 0 || image_end + blocks <= device_blocks) {
+      ckpt_start = (uint32_t)image_end;
+    }else {
+      //overwriting the current image would leave nothing to recover from
+      //if the new one is torn, and the log behind it is truncated already
+      debug_error("No room for a second checkpoint image. Checkpoint refused.");
+      ckpt_failures++;
+      log_cv.notify_all();
+      return false;
+    }
+  }
+  //the checkpoint holds everything appended so far
+  ckpt_log_block = block_offset;
+  ckpt_log_entry = cur_block.entry_cnt;
+  ckpt_log_generation = block_generation;
+  ckpt_lsn = appended_lsn;
+  return true;
+}
+
+void server_log::reserve_checkpoint_buffers() {
+  if (checkpt_format != CHECKPT_FORMAT_VARINT) {
+    return;
+  }
+  size_t degree = 0;
+  if (ckpt_full) {
+    ckpt_nodes.reserve(graph->g.size());
+    for (auto& p : graph->g) {
+      degree = std::max(degree, p.second.size());
+    }
+  }else {
+    ckpt_ids.reserve(graph->dirty.size());
+    for (uint64_t n : graph->dirty) {
+      auto it = graph->g.find(n);
+      if (it != graph->g.end()) {
+        degree = std::max(degree, it->second.size());
+      }
+    }
+  }
+  ckpt_neighbors.reserve(degree);
+}
+
+void server_log::release_checkpoint_buffers() {
+  std::vector<std::pair<uint64_t, const neighbor_set_t*> >().swap(ckpt_nodes);
+  std::vector<uint64_t>().swap(ckpt_ids);
+  std::vector<uint64_t>().swap(ckpt_neighbors);
+}
+
+uint32_t server_log::write_planned_checkpoint() {
+  checkpt_error = 0;
+  if (ckpt_full) {
+    write_base_checkpoint(ckpt_start);
+  }else {
+    write_delta_checkpoint(ckpt_start);
+  }
+  return checkpt_offset - ckpt_start;
+}
+
+void server_log::commit_checkpoint_locked() {
+  if (ckpt_full) {
+    super_block.checkpoint_start = ckpt_start;
+    super_block.checkpoint_size = ckpt_blocks;
+    super_block.delta_size = 0;
+    super_block.checkpoint_format = checkpt_format;
+  }else {
+    super_block.delta_size += ckpt_blocks;
+  }
+  uint32_t old_start = super_block.log_start;
+  bool new_generation = appended_lsn == ckpt_lsn;
+  if (new_generation) {
+    //nothing was logged after the snapshot, start a new log generation
+    super_block.generation_num = super_block.max_generation + 1;
+    super_block.max_generation = super_block.generation_num;
+    super_block.log_start = 1;
+    super_block.log_start_entry = 0;
+    block_offset = super_block.log_start;
+    block_generation = super_block.generation_num;
+    new_cur_block();
+  }else {
+    //truncate the log up to the snapshot, recovery replays the rest on top
+    super_block.generation_num = ckpt_log_generation;
+    super_block.log_start = ckpt_log_block;
+    super_block.log_start_entry = ckpt_log_entry;
+  }
+  sync_super_block();
+  //the super block doesn't point to the truncated blocks anymore
+  if (new_generation) {
+    storage->release_blocks(1, super_block.log_size - 1);
+  }else {
+    release_log_locked(old_start, super_block.log_start);
+  }
+}
+
+void server_log::release_log_locked(uint32_t from, uint32_t to) {
+  if (from <= to) {
+    storage->release_blocks(from, to - from);
+    return;
+  }
+  //the range wraps around the end of the ring
+  storage->release_blocks(from, super_block.log_size - from);
+  storage->release_blocks(1, to - 1);
+}
+
+bool server_log::checkpoint() {
+  debug_info("Creating checkpoint.");
+  while (true) {
+    wait_checkpoint();
+    //mutations hold the graph lock while appending to the log,
+    //so take the graph lock before log_mutex as they do.
+    //the read lock keeps mutations and their dirty marks out
+    graph_read_guard rg(graph);
+    //make pending group commit entries durable before the log is reset
+    flush_log();
+    std::lock_guard<std::mutex> lk(log_mutex);
+    if (ckpt_running) {
+      //a background checkpoint started in between
+      continue;
+    }
+    if (!plan_checkpoint_locked()) {
+      return false;
+    }
+    ckpt_blocks = write_planned_checkpoint();
+    release_checkpoint_buffers();
+    return finish_checkpoint_locked();
+  }
+}
+
+bool server_log::finish_checkpoint_locked() {
+  if (checkpt_error != 0) {
+    //the super block still points to the old image, the log isn't truncated
+    debug_error("Write checkpoint failed: %s.", strerror(checkpt_error));
+    ckpt_failures++;
+    log_cv.notify_all();
+    return false;
+  }
+  commit_checkpoint_locked();
+  graph->dirty.clear();
+  return true;
+}
+
+bool server_log::start_checkpoint() {
+  debug_info("Starting background checkpoint.");
+  graph_read_guard rg(graph);
+  flush_log();
+  std::unique_lock<std::mutex> lk(log_mutex);
+  if (ckpt_running) {
+    return true;
+  }
+  if (!plan_checkpoint_locked()) {
+    return false;
+  }
+  //the child must not create files, storage locks may be held by threads
+  //it doesn't have
+  if (!storage->reserve_blocks(ckpt_start, ckpt_blocks)) {
+    debug_error("Reserve checkpoint blocks failed.");
+    ckpt_failures++;
+    log_cv.notify_all();
+    return false;
+  }
+  //the child of this multithreaded process may only make async-signal-safe
+  //calls: malloc, stdio and debug_* may wait for locks held by threads it
+  //doesn't have. it writes the copy-on-write image of the graph as of now
+  //with the buffers sized here, std::sort sorts in place, and reports the
+  //blocks it wrote through a pipe, ckpt_blocks is only a bound for the
+  //varint format
+  reserve_checkpoint_buffers();
+  int fds[2] = {-1, -1};
+  pid_t pid = pipe(fds) == 0 ? fork() : -1;
+  if (pid == 0) {
+    uint32_t written = write_planned_checkpoint();
+    bool ok = checkpt_error == 0 && written <= ckpt_blocks
+        && write(fds[1], &written, sizeof(written)) == sizeof(written);
+    _exit(ok ? 0 : 1);
+  }
+  if (pid < 0) {
+    debug_warn("Fork failed. Checkpoint in place.");
+    if (fds[0] >= 0) {
+      close(fds[0]);
+      close(fds[1]);
+    }
+    ckpt_blocks = write_planned_checkpoint();
+    release_checkpoint_buffers();
+    return finish_checkpoint_locked();
+  }
+  release_checkpoint_buffers();
+  //mutations from now on go to the next checkpoint
+  ckpt_running = true;
+  ckpt_dirty.swap(graph->dirty);
+  graph->dirty.clear();
+  close(fds[1]);
+  std::thread(&server_log::finish_background_checkpoint, this, pid, fds[0]).detach();
+  return true;
+}
+
+void server_log::finish_background_checkpoint(pid_t pid, int fd) {
+  int status = 0;
+  while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+  }
+  uint32_t written = 0;
+  bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0
+      && read(fd, &written, sizeof(written)) == sizeof(written);
+  close(fd);
+  if (!ok) {
+    debug_error("Background checkpoint failed.");
+    //the vertices of the lost checkpoint go to the next one
+    graph_write_guard wg(graph);
+    graph->dirty.insert(ckpt_dirty.begin(), ckpt_dirty.end());
+  }
+  std::lock_guard<std::mutex> lk(log_mutex);
+  if (ok) {
+    ckpt_blocks = written;
+    commit_checkpoint_locked();
+  }else {
+    ckpt_failures++;
+  }
+  ckpt_dirty.clear();
+  ckpt_running = false;
+  log_cv.notify_all();
+}
+
+bool server_log::checkpoint_running() {
+  std::lock_guard<std::mutex> lk(log_mutex);
+  return ckpt_running;
+}
+
+void server_log::wait_checkpoint() {
+  std::unique_lock<std::mutex> lk(log_mutex);
+  while (ckpt_running) {
+    log_cv.wait(lk);
+  }
+}
+
+void server_log::start_checkpointer(uint32_t percent) {
+  auto_checkpoint_percent = percent;
+  if (percent > 0) {
+    checkpointer = std::thread(&server_log::run_checkpointer, this);
+  }
+}
+
+void server_log::run_checkpointer() {
+  std::unique_lock<std::mutex> lk(log_mutex);
+  uint64_t failures = ckpt_failures;
+  while (!checkpointer_stop) {
+    if (ckpt_failures != failures) {
+      //don't retry a failing checkpoint in a tight loop
+      failures = ckpt_failures;
+      log_cv.wait_for(lk, std::chrono::seconds(1), [this]() { return checkpointer_stop; });
+      continue;
+    }
+    if (ckpt_running || (room_waiters == 0
+        && log_used_blocks_locked() * 100ULL < (uint64_t)checkpoint_span_locked() * auto_checkpoint_percent)) {
+      log_cv.wait(lk);
+      continue;
+    }
+    lk.unlock();
+    start_checkpoint();
+    lk.lock();
+  }
+}
+
+uint32_t server_log::checkpoint_span_locked() {
+  //a segmented log never fills up, checkpoint it as often as a device log
+  //to bound the recovery time
+  return std::min<uint32_t>(super_block.log_size, LOG_SEG_SIZE) - 1;
+}
+
+uint32_t server_log::log_used_blocks_locked() {
+  uint32_t ring = super_block.log_size - 1;
+  return (block_offset + ring - super_block.log_start) % ring + 1;
+}
+
+bool server_log::log_has_room_locked(uint64_t n) {
+  //free slots in the current block plus all blocks up to log_start,
+  //counting varint entries at their largest size
+  uint64_t free_blocks = super_block.log_size - 1 - log_used_blocks_locked();
+  return n <= free_blocks * log_block_t::capacity(log_format) + cur_block.room(block_cursor);
 }
 
 bool server_log::log_is_full() {
-  return block_offset >= super_block.log_size;
+  return !log_has_room(1);
+}
+
+bool server_log::log_has_room(uint64_t n) {
+  std::lock_guard<std::mutex> lk(log_mutex);
+  return log_has_room_locked(n);
+}
+
+bool server_log::reserve_log(uint64_t n) {
+  std::unique_lock<std::mutex> lk(log_mutex);
+  if (write_error != 0) {
+    return false;
+  }
+  if (log_has_room_locked(n)) {
+    return true;
+  }
+  if (auto_checkpoint_percent == 0 || n > (uint64_t)(super_block.log_size - 1) * log_block_t::capacity(log_format)) {
+    return false;
+  }
+  //every checkpoint truncates the log up to its snapshot, a checkpoint
+  //started while we block the writers frees the whole log
+  uint64_t failures = ckpt_failures;
+  room_waiters++;
+  log_cv.notify_all();
+  while (!log_has_room_locked(n) && ckpt_failures == failures && !checkpointer_stop) {
+    log_cv.wait(lk);
+  }
+  room_waiters--;
+  return log_has_room_locked(n);
 }
 
 void server_log::close_log() {
-  close(fd);
+  if (reaper.joinable()) {
+    //let the writes in flight land, then stop the reaper
+    std::unique_lock<std::mutex> lk(log_mutex);
+    log_cv.wait(lk, [this]() { return direct_writes.empty(); });
+    storage->post_completion(REAPER_STOP);
+    lk.unlock();
+    reaper.join();
+  }
+  for (void* buf : direct_buffers) {
+    free(buf);
+  }
+  direct_buffers.clear();
+  if (storage != nullptr) {
+    storage->close();
+    delete storage;
+    storage = nullptr;
+  }
 }
 
 server_log::~server_log() {
+  if (checkpointer.joinable()) {
+    {
+      std::lock_guard<std::mutex> lk(log_mutex);
+      checkpointer_stop = true;
+    }
+    log_cv.notify_all();
+    checkpointer.join();
+  }
+  //the background checkpoint thread still uses the log
+  wait_checkpoint();
   close_log();
 }
@@ -9,7 +9,16 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <cstring>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <vector>
+#include <deque>
+#include <unordered_set>
 #include "graph.hpp"
+#include "storage.hpp"
 #include "types.hpp"
 #include "utility.hpp"
 
@@ -33,25 +42,41 @@ struct log_entry_t {
 };
 
 //4096 bytes
+//the log is a ring over blocks [1, log_size): log_start is its tail, the
+//oldest block recovery needs, and the head is the last block carrying the
+//generation of its lap, one more every time the log wraps around
 struct super_block_t {
   uint64_t checksum;
+  //generation of the log_start block
   uint32_t generation_num;
   uint32_t log_start;
   uint32_t log_size;
+  //blocks of the base image at log_size
   uint32_t checkpoint_size;
-  uint32_t reserved1;
-  uint32_t reserved2;
-  uint32_t reserved3;
-  uint32_t reserved4;
-
-  log_entry_t reserved[169];
+  //blocks of incremental checkpoints following the base image
+  uint32_t delta_size;
+  //block of the base image, 0 means log_size
+  uint32_t checkpoint_start;
+  //entries of the log_start block the checkpoint already contains
+  uint32_t log_start_entry;
+  //highest generation any log block was written with, raised before the
+  //log wraps so a new generation never matches a stale block
+  uint32_t max_generation;
+  //CHECKPT_FORMAT_* of the base image and its deltas, 0 for images written
+  //before the format was recorded, which are CHECKPT_FORMAT_PAIRS
+  uint32_t checkpoint_format;
+  //CHECKSUM_* of this block
+  uint32_t checksum_type;
+  uint32_t reserved5[4];
+
+  log_entry_t reserved[168];
 
   super_block_t() {
     clear_block((void*)this);
   }
 
   uint64_t compute_checksum() {
-    return compute_checksum_xor((void*)this);
+    return compute_block_checksum((void*)this, checksum_type);
   }
 
   void clear() {
@@ -59,25 +84,68 @@ struct super_block_t {
   }
 };
 
+//where the next entry of a LOG_FORMAT_VARINT block goes
+struct log_cursor_t {
+  //bytes of data the entries take
+  uint32_t bytes = 0;
+  //node1 of the last entry
+  uint64_t node1 = 0;
+};
+
 //4096 bytes
+//LOG_FORMAT_FIXED keeps entry_cnt entries in log_entry. LOG_FORMAT_VARINT
+//packs them into data one after another, each as
+//  opcode byte: the opcode, | 0x40 if node2 follows, | 0x80 if node1 is
+//  the one of the previous entry and left out, so a batch of edges of one
+//  node costs the opcode and the other end per edge
+//  varint node1, varint node2
+//a block takes entries as long as one of the largest size still fits
 struct log_block_t {
   uint64_t checksum;
   uint32_t generation_num;
-  uint32_t entry_cnt;
-
-  log_entry_t log_entry[170];
+  uint16_t entry_cnt;
+  //LOG_FORMAT_* of the entries, 0 in blocks written before the format was
+  //recorded, which are LOG_FORMAT_FIXED
+  uint8_t format;
+  //CHECKSUM_* of this block
+  uint8_t checksum_type;
+
+  union {
+    log_entry_t log_entry[170];
+    uint8_t data[4080];
+  };
 
   log_block_t() {
     clear_block((void*)this);
   }
 
-  uint64_t compute_checksum() {
-    return compute_checksum_xor((void*)this);
-  }
+  //checksum of the header and of the bytes of data the entries take. the
+  //rest of data is left out, so a block written sector by sector still
+  //matches the checksum of its header while sectors past its entries change
+  uint64_t compute_checksum(const log_cursor_t& cursor) const;
+
+  //whether the entries decode and the block matches its checksum
+  bool verify() const;
 
   void clear() {
     clear_block((void*)this);
   }
+
+  //entries an empty block of the given format takes at least
+  static uint32_t capacity(uint32_t format);
+
+  //entries the block takes at least, 0 if it is full
+  uint32_t room(const log_cursor_t& cursor) const;
+
+  //bytes of data the entries take
+  uint32_t used_bytes(const log_cursor_t& cursor) const;
+
+  //append an entry, the block must not be full
+  void append(const log_entry_t& entry, log_cursor_t* cursor);
+
+  //append the entries of the block to out, if not null, and set cursor
+  //past the last one. return false if the block is corrupt
+  bool decode(std::vector<log_entry_t>* out, log_cursor_t* cursor) const;
 };
 
 //16 bytes
@@ -87,13 +155,26 @@ struct edge_t {
 };
 
 //4096 bytes
+//CHECKPT_FORMAT_PAIRS keeps entry_cnt pairs in edges. CHECKPT_FORMAT_VARINT
+//keeps entry_cnt vertex records in the first data_size bytes of data:
+//  varint node minus the node of the previous record, absolute in the first
+//  varint degree of the node
+//  varint count << 1, | 1 if earlier records hold some of its neighbors
+//  count neighbors ascending, the first as zigzag varint of its difference
+//  to the node, the others as varint gaps
+//a node whose neighbors don't fit continues in the next block, so every
+//block decodes on its own
 struct checkpt_block_t {
   uint32_t entry_cnt;
-  uint32_t reserved1;
-  uint32_t reserved2;
+  //one of CHECKPT_*
+  uint32_t kind;
+  uint32_t data_size;
   uint32_t reserved3;
 
-  edge_t edges[255];
+  union {
+    edge_t edges[255];
+    uint8_t data[4080];
+  };
 
   checkpt_block_t() {
     clear_block((void*)this);
@@ -105,25 +186,268 @@ struct checkpt_block_t {
 
 };
 
+//an asynchronous log block write in flight, see log_storage
+struct direct_write_t {
+  //entries up to lsn are durable once this and all earlier writes completed
+  uint64_t lsn;
+  uint32_t offset;
+  //aligned copy of the block
+  void* buf;
+  //requests of the write not completed yet
+  uint32_t pending;
+  //bytes each request of the write must complete with
+  uint32_t len[2];
+};
+
 class server_log {
   private:
-    const char* log;
-
-    int fd = -1;
+    //STORAGE_* attach_log opens, and the LOG_IO_* of STORAGE_DEVICE
+    int storage_type = STORAGE_DEVICE;
+    int log_io = LOG_IO_MMAP;
+    log_storage* storage = nullptr;
+    //log blocks go through submit_cur_block_locked: the storage writes
+    //asynchronously, completed on the reaper thread, or in sectors
+    bool submit_writes = false;
+    std::thread reaper;
+    //bytes this process handed to the log device, for benchmarks
+    std::atomic<uint64_t> bytes_written{0};
     super_block_t super_block;
     log_block_t cur_block;
     checkpt_block_t checkpt_block;
 
     uint32_t block_offset;
+    //generation of the block at block_offset
+    uint32_t block_generation = 0;
+    //append position in cur_block
+    log_cursor_t block_cursor;
+    //bytes at the start of cur_block the device already holds, 0 if it was
+    //never written and everything has to go out
+    uint32_t block_written = 0;
+    //LOG_FORMAT_* new log blocks are written in
+    uint32_t log_format = LOG_FORMAT_VARINT;
+    //CHECKSUM_* new log blocks and the super block are written with
+    uint32_t checksum_type = CHECKSUM_CRC32C;
+    //block checkpt_block is written to
+    uint32_t checkpt_offset;
+    //node of the last record in checkpt_block
+    uint64_t checkpt_prev_node = 0;
+    //errno of the first checkpoint block write that failed, 0 if none did
+    int checkpt_error = 0;
+    //CHECKPT_FORMAT_* new images are written in
+    uint32_t checkpt_format = CHECKPT_FORMAT_VARINT;
+    //size of the log device in blocks
+    uint64_t device_blocks = 0;
+    //compact into a new base image once the deltas would exceed this
+    //percentage of the base, 0 writes a full image on every checkpoint
+    uint32_t compact_percent = 50;
+
+    //checkpoint being written: a base image or a delta of at most
+    //ckpt_blocks blocks at ckpt_start, holding the graph as of log position
+    //<ckpt_log_block, ckpt_log_entry>, i.e. up to ckpt_lsn
+    bool ckpt_running = false;
+    bool ckpt_full = false;
+    uint32_t ckpt_start = 0;
+    uint32_t ckpt_blocks = 0;
+    uint32_t ckpt_log_block = 0;
+    uint32_t ckpt_log_entry = 0;
+    uint32_t ckpt_log_generation = 0;
+    uint64_t ckpt_lsn = 0;
+    //background checkpoints that failed so far
+    uint64_t ckpt_failures = 0;
+    //dirty vertices the running checkpoint writes, restored if it fails
+    std::unordered_set<uint64_t> ckpt_dirty;
+    //buffers the CHECKPT_FORMAT_VARINT writers sort vertices and neighbors
+    //in, sized before a fork as the checkpoint process must not allocate
+    std::vector<std::pair<uint64_t, const neighbor_set_t*> > ckpt_nodes;
+    std::vector<uint64_t> ckpt_ids;
+    std::vector<uint64_t> ckpt_neighbors;
 
     struct Graph* graph = nullptr;
 
+    //threads recovery checks and replays the log with
+    uint32_t recovery_threads = 1;
+
+    //group commit: entries are appended to cur_block in memory and made
+    //durable together, 0 means every entry is written and synced at once
+    uint32_t group_commit_delay_us = 0;
+    //number of entries appended / durable on the log device
+    uint64_t appended_lsn = 0;
+    uint64_t durable_lsn = 0;
+    //highest lsn a write was started for
+    uint64_t submitted_lsn = 0;
+    //storage writes in flight in submission order, request k of the front
+    //one has tag direct_tag * 2 + k. durable_lsn follows the completed prefix
+    std::deque<direct_write_t> direct_writes;
+    uint64_t direct_tag = 0;
+    //errno of the first log block write that failed or came up short, 0
+    //if none did. durable_lsn stays before the hole it left for good
+    int write_error = 0;
+    //aligned buffers of completed writes, reused
+    std::vector<void*> direct_buffers;
+    //called on the reaper thread, without log_mutex, when durable_lsn moved
+    std::function<void()> durable_callback;
+    //a thread is writing cur_block out without holding log_mutex
+    bool flushing = false;
+    //a thread is collecting a batch and will flush it
+    bool flush_leader = false;
+    std::mutex log_mutex;
+    std::condition_variable log_cv;
+
+    //automatic checkpoints: start one when the ring is this percent full or
+    //a writer waits for room, 0 disables them
+    uint32_t auto_checkpoint_percent = 0;
+    //writers blocked in reserve_log
+    uint32_t room_waiters = 0;
+    bool checkpointer_stop = false;
+    std::thread checkpointer;
+
+    void run_checkpointer();
+
+    //log blocks between log_start and block_offset, both included
+    uint32_t log_used_blocks_locked();
+
+    //log blocks automatic checkpoint percentages refer to
+    uint32_t checkpoint_span_locked();
+
+    bool log_has_room_locked(uint64_t n);
+
+    //move block_offset to the next block of the ring
+    void next_block_locked();
+
+    //start an empty cur_block in log_format
+    void new_cur_block();
+
+    //checksum super_block with checksum_type and write it
+    void sync_super_block();
+
+    void flush_locked(std::unique_lock<std::mutex>& lk);
+
+    //append one entry to cur_block, moving to the next block if it's full
+    void append_locked(const log_entry_t& entry);
+
+    //write cur_block through and mark all appended entries durable, on a
+    //storage with submit_writes only start the write
+    void write_cur_block_locked(std::unique_lock<std::mutex>& lk);
+
+    //queue a write of a copy of cur_block on the storage, waiting while
+    //DIRECT_QUEUE_DEPTH writes are in flight. write it synchronously if the
+    //storage has no asynchronous writes
+    void submit_cur_block_locked(std::unique_lock<std::mutex>& lk);
+
+    //byte ranges [from, to) of cur_block that differ from the device, in the
+    //order they must reach it: the sectors appended to since the last write,
+    //then the header sector. the header commits the entries, so a crash
+    //between the two leaves the old header and entries matching their
+    //checksum. the whole block if it was never written. return the number
+    //of ranges
+    uint32_t dirty_ranges_locked(uint32_t* from, uint32_t* to);
+
+    //complete the asynchronous writes in order and advance durable_lsn
+    void run_reaper();
+
+    //write checkpt_block out and start the next block
+    void flush_checkpt_block();
+
+    //write the whole graph as a base image starting at block start
+    void write_base_checkpoint(uint32_t start);
+
+    //write the dirty vertices as a delta starting at block start
+    void write_delta_checkpoint(uint32_t start);
+
+    //blocks write_base_checkpoint / write_delta_checkpoint write, an upper
+    //bound for CHECKPT_FORMAT_VARINT
+    uint64_t base_checkpoint_blocks();
+
+    uint64_t delta_checkpoint_blocks();
+
+    //choose between base image and delta and where it goes, and record
+    //the log position it covers. called with the graph locked and the log
+    //flushed, holding log_mutex. return false, counting a failed
+    //checkpoint, if the device has no room for a base image next to the
+    //current one
+    bool plan_checkpoint_locked();
+
+    //size ckpt_nodes, ckpt_ids and ckpt_neighbors for the planned checkpoint
+    void reserve_checkpoint_buffers();
+
+    void release_checkpoint_buffers();
+
+    //return the number of blocks written, checkpt_error tells if they all were
+    uint32_t write_planned_checkpoint();
+
+    //switch the super block to the written checkpoint of ckpt_blocks blocks
+    void commit_checkpoint_locked();
+
+    //commit a checkpoint written in this process unless a block write
+    //failed, return whether it was committed
+    bool finish_checkpoint_locked();
+
+    //let the storage drop the log blocks [from, to) of the ring
+    void release_log_locked(uint32_t from, uint32_t to);
+
+    //wait for the checkpoint process, read the number of blocks it wrote
+    //from fd and commit its checkpoint
+    void finish_background_checkpoint(pid_t pid, int fd);
+
+    //CHECKPT_FORMAT_* of the image the super block points to
+    uint32_t image_format();
+
+    void read_block(void* buf, uint32_t offset);
+
+    //read n consecutive blocks in one go
+    void read_blocks(void* buf, uint32_t offset, uint32_t n);
+
+    //ask the kernel to read n blocks at offset ahead of time
+    void prefetch_blocks(uint32_t offset, uint32_t n);
+
+    //number of leading blocks with a valid checksum and the given
+    //generation, checked by the recovery threads
+    uint32_t count_valid_blocks(const log_block_t* blocks, uint32_t n, uint32_t generation);
+
+    //load a base image of blocks blocks: the nodes go into a presized
+    //vertex table, every neighbor set is sized once by the degrees stored
+    //with the records or counted for the pairs format, before the threads
+    //fill in the edges of the vertices they own
+    void load_base_checkpoint(uint32_t start, uint32_t blocks);
+
+    //read base image blocks [from, blocks) in chunks and call fn(it, other)
+    //for both ends <it->first, other> of every edge, on the thread owning
+    //it->first. the vertex table must not change meanwhile
+    void for_each_base_edge(std::vector<checkpt_block_t>& chunk, uint32_t start, uint32_t from,
+        uint32_t blocks, const std::function<void(adjacency_t::iterator, uint64_t)>& fn);
+
+    //apply replayed entries in order, see replay_run
+    void replay_entries(const std::vector<log_entry_t>& entries);
+
+    //apply entries [begin, end) which contain no node removal. nodes are
+    //added first, then every thread applies the edge operations of the
+    //vertices it owns, in log order
+    void replay_run(const std::vector<log_entry_t>& entries, size_t begin, size_t end);
+
+    //0 or -errno
+    int write_block(const void* buf, uint32_t offset);
+
+    //a synchronous write of block offset holding the log up to lsn
+    //returned res, 0 or -errno. as with the asynchronous writes, nothing
+    //after a failed write ever becomes durable
+    void complete_write_locked(uint32_t offset, uint64_t lsn, int res);
+
   public:
 
     void bind_graph(struct Graph* g);
 
+    //must be called before attach_log
+    void set_log_io(int io);
+
+    //STORAGE_*, must be called before attach_log
+    void set_storage(int type);
+
+    //open the storage of the set type at devfile
     void attach_log(const string& devfile);
 
+    //keep the log in s, opened already. the log owns it from now on
+    void attach_storage(log_storage* s);
+
     void init_server_log();
 
     void init_superblock();
@@ -136,13 +460,62 @@ class server_log {
 
     void read_in_checkpt_block(checkpt_block_t* cb, uint32_t offset);
 
-    void write_super_block(super_block_t* sb);
+    //the writes return 0 or -errno
+    int write_super_block(super_block_t* sb);
+
+    int write_log_block(log_block_t* lb, uint32_t offset);
+
+    int write_checkpt_block(checkpt_block_t* cb, uint32_t offset);
+
+    //return the log sequence number of the new entry
+    uint64_t add_log_entry(uint32_t opcode, uint64_t node1, uint64_t node2);
+
+    //append several entries, writing every touched block once,
+    //return the log sequence number of the last entry
+    uint64_t add_log_entries(const std::vector<log_entry_t>& entries);
+
+    void set_group_commit_delay(uint32_t delay_us);
+
+    //LOG_FORMAT_* of new log blocks, blocks in the other format are still
+    //replayed and the last one is filled up in its own format
+    void set_log_format(uint32_t format);
+
+    //CHECKSUM_* of the blocks written from now on, every block is checked
+    //with the type in its own header
+    void set_checksum_type(uint32_t type);
+
+    //threads checking and applying the log during recovery
+    void set_recovery_threads(uint32_t threads);
 
-    void write_log_block(log_block_t* lb, uint32_t offset);
+    uint32_t get_group_commit_delay();
 
-    void write_checkpt_block(checkpt_block_t* cb, uint32_t offset);
+    //write all appended entries to the log device with a single sync
+    void flush_log();
 
-    void add_log_entry(uint32_t opcode, uint64_t node1, uint64_t node2);
+    //start writing all appended entries without waiting for them. on a
+    //storage with asynchronous writes (LOG_IO_DIRECT) the durable callback
+    //runs once they are durable, the others write synchronously
+    void start_flush_log();
+
+    //run cb whenever entries became durable asynchronously
+    void set_durable_callback(std::function<void()> cb);
+
+    //bytes written to the log device so far
+    uint64_t get_bytes_written();
+
+    //block until the entry with the given sequence number is durable,
+    //the first waiter gathers a batch for up to the group commit delay.
+    //false if a failed log write keeps it from ever becoming durable
+    bool wait_durable(uint64_t lsn);
+
+    uint64_t get_durable_lsn();
+
+    //errno of a failed log write, after which nothing becomes durable and
+    //reserve_log refuses new entries. 0 if the log is fine
+    int get_write_error();
+
+    //lsn of the last appended entry, durable or not
+    uint64_t get_appended_lsn();
 
     void recover_status();
 
@@ -152,12 +525,53 @@ class server_log {
 
     void execute_log_entry(log_entry_t* entry);
 
-    void add_checkpt_entry(uint64_t node1, uint64_t node2);
+    void add_checkpt_entry(uint32_t kind, uint64_t node1, uint64_t node2);
+
+    //append the record of node and its count sorted neighbors in the
+    //CHECKPT_FORMAT_VARINT format, splitting it over blocks as needed.
+    //records must come in ascending node order within a block
+    void add_checkpt_record(uint32_t kind, uint64_t node, uint32_t degree,
+        const uint64_t* neighbors, uint32_t count);
+
+    void set_checkpoint_compaction(uint32_t percent);
 
-    void checkpoint();
+    //CHECKPT_FORMAT_* of new checkpoints, an image in the other format is
+    //still loaded and replaced by the next checkpoint
+    void set_checkpoint_format(uint32_t format);
+
+    //persist the graph and start a new log generation. only vertices
+    //changed since the last checkpoint are written, as a delta, until the
+    //deltas outgrow the compaction threshold or the device. return false
+    //if the checkpoint couldn't be written
+    bool checkpoint();
+
+    //take a snapshot of the graph and write the checkpoint from a forked
+    //process while mutations go on. the super block switches to it once it
+    //is durable, the log after the snapshot stays valid on top of it.
+    //return false if the checkpoint can't be started, a call while one is
+    //running is a no-op
+    bool start_checkpoint();
+
+    bool checkpoint_running();
+
+    void wait_checkpoint();
+
+    //start a thread checkpointing in the background whenever the log is
+    //percent full, truncating the log behind the checkpoint.
+    //call after recovery, 0 leaves checkpoints to the caller
+    void start_checkpointer(uint32_t percent);
 
     bool log_is_full();
 
+    //whether the log can take n more entries
+    bool log_has_room(uint64_t n);
+
+    //wait until the log can take n more entries, checkpointing to make room
+    //if automatic checkpoints are on. return false if it can't: they are
+    //off, a checkpoint failed, n exceeds the whole log or a log write failed.
+    //callers keep other writers out until they appended the entries
+    bool reserve_log(uint64_t n);
+
     void close_log();
 
     ~server_log();
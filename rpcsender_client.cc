@@ -4,25 +4,117 @@
 #include <iostream>
 #include <memory>
 #include <string>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <functional>
+#include <condition_variable>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <random>
 
 #include <grpc++/grpc++.h>
 
 #include "graphserverRPC.grpc.pb.h"
+#include "log.hpp"
+#include "types.hpp"
 
 using grpc::Channel;
 using grpc::ClientContext;
+using grpc::ClientReaderWriter;
 using grpc::Status;
 using graphserverRPC::AddNodeRequest;
 using graphserverRPC::AddEdgeRequest;
 using graphserverRPC::RemoveNodeRequest;
 using graphserverRPC::RemoveEdgeRequest;
 using graphserverRPC::RPCReply;
+using graphserverRPC::Operation;
+using graphserverRPC::BatchRequest;
+using graphserverRPC::BatchReply;
+using graphserverRPC::OpsV2;
+using graphserverRPC::ReplyV2;
 using graphserverRPC::rpcsender;
+using graphserverRPC::rpcsenderV2;
+
+static void ops_to_v2(const std::vector<log_entry_t>& ops, OpsV2* msg) {
+  msg->mutable_opcode()->Reserve(ops.size());
+  msg->mutable_node_id_a()->Reserve(ops.size());
+  msg->mutable_node_id_b()->Reserve(ops.size());
+  for (const log_entry_t& op : ops) {
+    msg->add_opcode(op.opcode);
+    msg->add_node_id_a(op.node1);
+    msg->add_node_id_b(op.node2);
+  }
+}
+
+// return false if the parallel arrays of msg differ in length
+static bool ops_from_v2(const OpsV2& msg, std::vector<log_entry_t>* ops) {
+  int n = msg.opcode_size();
+  if (msg.node_id_a_size() != n || msg.node_id_b_size() != n) {
+    return false;
+  }
+  ops->reserve(n);
+  for (int i = 0; i < n; ++i) {
+    ops->push_back(log_entry_t(msg.opcode(i), msg.node_id_a(i), msg.node_id_b(i)));
+  }
+  return true;
+}
 
 class rpcsenderClient {
   public:
-    rpcsenderClient(std::shared_ptr<Channel> channel)
-      : stub_(rpcsender::NewStub(channel)) {}
+    // version is the rpc version Forward speaks, 1 for a next node that
+    // doesn't serve rpcsenderV2 yet
+    rpcsenderClient(std::shared_ptr<Channel> channel, int version = 1)
+      : stub_(rpcsender::NewStub(channel)),
+        stub_v2_(rpcsenderV2::NewStub(channel)),
+        version_(version) {}
+
+    // Replicates ops to the next node in order and returns false if it
+    // failed to apply them. v2 sends them as one Apply, v1 a batch as one
+    // SendBatch and a single op as its string rpc. A next node without
+    // rpcsenderV2 gets v1 from then on. Callers hold the write mutex.
+    bool Forward(const std::vector<log_entry_t>& ops) {
+      if (version_ >= 2) {
+        OpsV2 request;
+        ops_to_v2(ops, &request);
+        ReplyV2 reply;
+        ClientContext context;
+        Status status = stub_v2_->Apply(&context, request, &reply);
+        if (status.error_code() != grpc::StatusCode::UNIMPLEMENTED) {
+          return status.ok() && reply.code() == 0;
+        }
+        // the next node didn't apply anything, resend in v1
+        version_ = 1;
+      }
+      if (ops.size() > 1) {
+        return SendBatch(ops) != "RPC failed";
+      }
+      for (const log_entry_t& op : ops) {
+        std::string reply;
+        std::string node_id_a = std::to_string(op.node1);
+        std::string node_id_b = std::to_string(op.node2);
+        switch (op.opcode) {
+          case OP_ADD_NODE:
+            reply = SendAddNode(node_id_a);
+            break;
+          case OP_ADD_EDGE:
+            reply = SendAddEdge(node_id_a, node_id_b);
+            break;
+          case OP_REMOVE_NODE:
+            reply = SendRemoveNode(node_id_a);
+            break;
+          default:
+            reply = SendRemoveEdge(node_id_a, node_id_b);
+            break;
+        }
+        if (reply == "RPC failed") {
+          return false;
+        }
+      }
+      return true;
+    }
 
     // Assambles the client's payload, sends it and presents the response back
     // from the server.
@@ -120,8 +212,222 @@ class rpcsenderClient {
       }
     }
 
+    std::string SendBatch(const std::vector<log_entry_t>& ops) {
+      // Data we are sending to the server.
+      BatchRequest request;
+      for (const log_entry_t& op : ops) {
+        Operation* operation = request.add_operations();
+        operation->set_opcode(op.opcode);
+        operation->set_node_id_a(op.node1);
+        operation->set_node_id_b(op.node2);
+      }
+
+      // Container for the data we expect from the server.
+      BatchReply reply;
+
+      // Context for the client. It could be used to convey extra information to
+      // the server and/or tweak certain RPC behaviors.
+      ClientContext context;
+
+      // The actual RPC.
+      Status status = stub_->SendBatch(&context, request, &reply);
+
+      // Act upon its status.
+      if (status.ok()) {
+        return reply.message();
+      } else {
+        return "RPC failed";
+      }
+    }
 
   private:
     std::unique_ptr<rpcsender::Stub> stub_;
+    std::unique_ptr<rpcsenderV2::Stub> stub_v2_;
+    int version_;
+};
+
+// Pipelined replication to the next node: mutations are streamed with
+// increasing sequence numbers without waiting for the round trip, the next
+// node acks a sequence number once it and every node after it made it
+// durable. Acks are cumulative because the stream keeps mutations in order.
+// Mutations not acked yet stay queued: when the stream breaks they are
+// reported lost to their callers and resent on a new stream, tagged with
+// the epoch of this replicator so the next node skips the ones it already
+// applied.
+class chainReplicator {
+  public:
+    chainReplicator(std::shared_ptr<Channel> channel)
+      : stub_(rpcsenderV2::NewStub(channel)) {
+      std::random_device rd;
+      epoch_ = ((uint64_t)rd() << 32 | rd()) + 1;
+    }
+
+    // Called from the ack reader thread whenever acks advance or the stream
+    // fails, without holding any lock. Not called from Send, which may run
+    // on the thread the callback wakes up: its caller checks State itself.
+    void SetAckCallback(std::function<void()> cb) {
+      on_ack_ = cb;
+    }
+
+    // Streams ops to the next node and returns their sequence number.
+    // Callers serialize Send (they hold the write mutex) so the sequence
+    // order is the order the ops were applied in.
+    uint64_t Send(const std::vector<log_entry_t>& ops) {
+      OpsV2 request;
+      ops_to_v2(ops, &request);
+      std::lock_guard<std::mutex> sl(send_mutex_);
+      std::shared_ptr<Stream> stream;
+      {
+        std::lock_guard<std::mutex> lk(mutex_);
+        request.set_seq(++sent_seq_);
+        unacked_.push_back(request);
+        if (stream_ != nullptr && !broken_) {
+          stream = stream_;
+        }
+      }
+      if (stream == nullptr) {
+        //the new stream resends request with the rest of the backlog
+        Reopen(false);
+      }else if (!stream->rw->Write(request)) {
+        Fail(stream, false);
+      }
+      return request.seq();
+    }
+
+    // Highest sequence number sent so far.
+    uint64_t LastSent() {
+      std::lock_guard<std::mutex> lk(mutex_);
+      return sent_seq_;
+    }
+
+    // 1 if seq is acked by the rest of the chain, -1 if a stream failed
+    // before it was acked, 0 if it is still in flight. seq 0 is always acked.
+    // A lost seq is resent and may still turn 1 later.
+    int State(uint64_t seq) {
+      std::lock_guard<std::mutex> lk(mutex_);
+      return StateLocked(seq);
+    }
+
+    // Block until seq is acked or failed, return true if it was acked.
+    bool WaitAcked(uint64_t seq) {
+      std::unique_lock<std::mutex> lk(mutex_);
+      cv_.wait(lk, [this, seq]() { return StateLocked(seq) != 0; });
+      return StateLocked(seq) == 1;
+    }
+
+  private:
+    // One Replicate call, shared with its ack reader thread.
+    struct Stream {
+      ClientContext context;
+      std::unique_ptr<ClientReaderWriter<OpsV2, ReplyV2> > rw;
+    };
+
+    std::unique_ptr<rpcsenderV2::Stub> stub_;
+    uint64_t epoch_;
+    std::function<void()> on_ack_;
+    // serializes writes to the stream, taken before mutex_
+    std::mutex send_mutex_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::shared_ptr<Stream> stream_;
+    bool broken_ = false;
+    uint64_t sent_seq_ = 0;
+    uint64_t acked_seq_ = 0;
+    // requests after acked_seq_, in sequence order
+    std::deque<OpsV2> unacked_;
+    // disjoint, increasing [first, last] ranges of sequence numbers sent on
+    // streams that failed before acking them
+    std::deque<std::pair<uint64_t, uint64_t> > failed_;
+
+    int StateLocked(uint64_t seq) {
+      if (seq <= acked_seq_) {
+        return 1;
+      }
+      auto it = std::upper_bound(failed_.begin(), failed_.end(),
+          std::pair<uint64_t, uint64_t>(seq, UINT64_MAX));
+      if (it != failed_.begin() && seq <= (--it)->second) {
+        return -1;
+      }
+      return 0;
+    }
+
+    // Start a new call and resend every request not acked yet, in order.
+    // Called with send_mutex_ held. The old reader thread owns its stream
+    // and exits on its own.
+    void Reopen(bool notify) {
+      std::shared_ptr<Stream> stream = std::make_shared<Stream>();
+      stream->context.AddMetadata("chain-epoch", std::to_string(epoch_));
+      stream->rw = stub_->Replicate(&stream->context);
+      std::deque<OpsV2> backlog;
+      {
+        std::lock_guard<std::mutex> lk(mutex_);
+        stream_ = stream;
+        broken_ = false;
+        backlog = unacked_;
+      }
+      std::thread(&chainReplicator::ReadAcks, this, stream).detach();
+      for (const OpsV2& request : backlog) {
+        if (stream->rw == nullptr || !stream->rw->Write(request)) {
+          Fail(stream, notify);
+          return;
+        }
+      }
+    }
+
+    void ReadAcks(std::shared_ptr<Stream> stream) {
+      ReplyV2 ack;
+      while (stream->rw != nullptr && stream->rw->Read(&ack)) {
+        {
+          std::lock_guard<std::mutex> lk(mutex_);
+          if (ack.seq() > acked_seq_) {
+            acked_seq_ = ack.seq();
+            while (!unacked_.empty() && unacked_.front().seq() <= acked_seq_) {
+              unacked_.pop_front();
+            }
+            while (!failed_.empty() && failed_.front().second <= acked_seq_) {
+              failed_.pop_front();
+            }
+          }
+        }
+        cv_.notify_all();
+        if (on_ack_) {
+          on_ack_();
+        }
+      }
+      if (stream->rw != nullptr) {
+        stream->context.TryCancel();
+        stream->rw->Finish();
+      }
+      Fail(stream, true);
+      //resend the backlog even if no new mutation comes along to do it
+      std::this_thread::sleep_for(std::chrono::milliseconds(CHAIN_RETRY_MS));
+      std::lock_guard<std::mutex> sl(send_mutex_);
+      {
+        std::lock_guard<std::mutex> lk(mutex_);
+        if (stream != stream_ || unacked_.empty()) {
+          return;
+        }
+      }
+      Reopen(true);
+    }
+
+    // Everything sent on a failed stream and not acked yet is lost for now.
+    void Fail(std::shared_ptr<Stream> stream, bool notify) {
+      {
+        std::lock_guard<std::mutex> lk(mutex_);
+        if (stream != stream_ || broken_) {
+          return;
+        }
+        broken_ = true;
+        uint64_t from = failed_.empty() ? acked_seq_ : std::max(acked_seq_, failed_.back().second);
+        if (sent_seq_ > from) {
+          failed_.push_back(std::make_pair(from + 1, sent_seq_));
+        }
+      }
+      cv_.notify_all();
+      if (notify && on_ack_) {
+        on_ack_();
+      }
+    }
 };
 #endif
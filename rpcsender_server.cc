@@ -6,6 +6,11 @@
 #include <string>
 #include <grpc++/grpc++.h>
 #include <cstdlib>
+#include <mutex>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <condition_variable>
 #include "graphserverRPC.grpc.pb.h"
 #include "rpcsender_client.cc"
 #include "log.hpp"
@@ -14,44 +19,35 @@
 using grpc::Server;
 using grpc::ServerBuilder;
 using grpc::ServerContext;
+using grpc::ServerReaderWriter;
 using grpc::Status;
 using graphserverRPC::AddNodeRequest;
 using graphserverRPC::AddEdgeRequest;
 using graphserverRPC::RemoveNodeRequest;
 using graphserverRPC::RemoveEdgeRequest;
 using graphserverRPC::RPCReply;
+using graphserverRPC::Operation;
+using graphserverRPC::BatchRequest;
+using graphserverRPC::BatchReply;
+using graphserverRPC::OpsV2;
+using graphserverRPC::ReplyV2;
 using graphserverRPC::rpcsender;
+using graphserverRPC::rpcsenderV2;
 
 // Logic and data behind the server's behavior.
 class rpcsenderServiceImpl final : public rpcsender::Service {
   Status SendAddNode(ServerContext* context, const AddNodeRequest* request,
       RPCReply* reply) override {
-    if (slog->log_is_full()) {
+    uint64_t node_id = strtoull(request->node_id().c_str(), nullptr, 10);
+    int code = apply_ops(std::vector<log_entry_t>(1, log_entry_t(OP_ADD_NODE, node_id, 0)), nullptr);
+    if (code == 507) {
       std::string prefix("Add node fail: log is full!");
       reply->set_message(prefix);
       return Status::CANCELLED;
-    }else {
-      if (grpc_client != nullptr) {
-        string rep = grpc_client->SendAddNode(request->node_id());
-        if (rep == "RPC failed") {
-          std::string prefix("Add node fail: rpc failed!");
-          reply->set_message(prefix);
-          return Status::CANCELLED;
-        }else {
-          uint64_t node_id = strtoull(request->node_id().c_str(), nullptr, 10);
-          int status_code = graph->addNode(node_id);
-          if (status_code == 200) {
-            slog->add_log_entry(OP_ADD_NODE, node_id, 0);
-          }
-        }
-      }else {
-        //this is the last node in the chain
-        uint64_t node_id = strtoull(request->node_id().c_str(), nullptr, 10);
-        int status_code = graph->addNode(node_id);
-        if (status_code == 200) {
-          slog->add_log_entry(OP_ADD_NODE, node_id, 0);
-        }
-      }
+    }else if (code != 0) {
+      std::string prefix("Add node fail: rpc failed!");
+      reply->set_message(prefix);
+      return Status::CANCELLED;
     }
     std::string prefix("Successfully added node: ");
     reply->set_message(prefix + request->node_id());
@@ -60,34 +56,17 @@ class rpcsenderServiceImpl final : public rpcsender::Service {
 
   Status SendAddEdge(ServerContext* context, const AddEdgeRequest* request,
       RPCReply* reply) override {
-    if (slog->log_is_full()) {
+    uint64_t node_id_a = strtoull(request->node_id_a().c_str(), nullptr, 10);
+    uint64_t node_id_b = strtoull(request->node_id_b().c_str(), nullptr, 10);
+    int code = apply_ops(std::vector<log_entry_t>(1, log_entry_t(OP_ADD_EDGE, node_id_a, node_id_b)), nullptr);
+    if (code == 507) {
       std::string prefix("Add edge fail: log is full!");
       reply->set_message(prefix);
       return Status::CANCELLED;
-    }else {
-      if (grpc_client != nullptr) {
-        string rep = grpc_client->SendAddEdge(request->node_id_a(), request->node_id_b());
-        if (rep == "RPC failed") {
-          std::string prefix("Add edge fail: rpc failed!");
-          reply->set_message(prefix);
-          return Status::CANCELLED;
-        }else {
-          uint64_t node_id_a = strtoull(request->node_id_a().c_str(), nullptr, 10);
-          uint64_t node_id_b = strtoull(request->node_id_b().c_str(), nullptr, 10);
-          int status_code = graph->addEdge(node_id_a, node_id_b);
-          if (status_code == 200) {
-            slog->add_log_entry(OP_ADD_EDGE, node_id_a, node_id_b);
-          }
-        }
-      }else {
-        //this is the last node in the chain
-        uint64_t node_id_a = strtoull(request->node_id_a().c_str(), nullptr, 10);
-        uint64_t node_id_b = strtoull(request->node_id_b().c_str(), nullptr, 10);
-        int status_code = graph->addEdge(node_id_a, node_id_b);
-        if (status_code == 200) {
-          slog->add_log_entry(OP_ADD_EDGE, node_id_a, node_id_b);
-        }
-      }
+    }else if (code != 0) {
+      std::string prefix("Add edge fail: rpc failed!");
+      reply->set_message(prefix);
+      return Status::CANCELLED;
     }
     std::string prefix("Successfully added edge: ");
     reply->set_message(prefix + request->node_id_a() + "," + request->node_id_b());
@@ -96,34 +75,17 @@ class rpcsenderServiceImpl final : public rpcsender::Service {
 
   Status SendRemoveNode(ServerContext* context, const RemoveNodeRequest* request,
       RPCReply* reply) override {
-    if (slog->log_is_full()) {
+    uint64_t node_id = strtoull(request->node_id().c_str(), nullptr, 10);
+    int code = apply_ops(std::vector<log_entry_t>(1, log_entry_t(OP_REMOVE_NODE, node_id, 0)), nullptr);
+    if (code == 507) {
       std::string prefix("Remove node fail: log is full!");
       reply->set_message(prefix);
       return Status::CANCELLED;
-    }else {
-      if (grpc_client != nullptr) {
-        string rep = grpc_client->SendRemoveNode(request->node_id());
-        if (rep == "RPC failed") {
-          std::string prefix("Remove node fail: rpc failed!");
-          reply->set_message(prefix);
-          return Status::CANCELLED;
-        }else {
-          uint64_t node_id = strtoull(request->node_id().c_str(), nullptr, 10);
-          int status_code = graph->removeNode(node_id);
-          if (status_code == 200) {
-            slog->add_log_entry(OP_REMOVE_NODE, node_id, 0);
-          }
-        }
-      }else {
-        //this is the last node in the chain
-        uint64_t node_id = strtoull(request->node_id().c_str(), nullptr, 10);
-        int status_code = graph->removeNode(node_id);
-        if (status_code == 200) {
-          slog->add_log_entry(OP_REMOVE_NODE, node_id, 0);
-        }
-      }
+    }else if (code != 0) {
+      std::string prefix("Remove node fail: rpc failed!");
+      reply->set_message(prefix);
+      return Status::CANCELLED;
     }
-
     std::string prefix("Successfully removed node: ");
     reply->set_message(prefix + request->node_id());
     return Status::OK;
@@ -131,44 +93,53 @@ class rpcsenderServiceImpl final : public rpcsender::Service {
 
   Status SendRemoveEdge(ServerContext* context, const RemoveEdgeRequest* request,
       RPCReply* reply) override {
-    if (slog->log_is_full()) {
+    uint64_t node_id_a = strtoull(request->node_id_a().c_str(), nullptr, 10);
+    uint64_t node_id_b = strtoull(request->node_id_b().c_str(), nullptr, 10);
+    int code = apply_ops(std::vector<log_entry_t>(1, log_entry_t(OP_REMOVE_EDGE, node_id_a, node_id_b)), nullptr);
+    if (code == 507) {
       std::string prefix("Remove edge fail: log is full!");
       reply->set_message(prefix);
       return Status::CANCELLED;
-    }else {
-      if (grpc_client != nullptr) {
-        string rep = grpc_client->SendRemoveEdge(request->node_id_a(), request->node_id_b());
-        if (rep == "RPC failed") {
-          std::string prefix("Remove edge fail: rpc failed!");
-          reply->set_message(prefix);
-          return Status::CANCELLED;
-        }else {
-          uint64_t node_id_a = strtoull(request->node_id_a().c_str(), nullptr, 10);
-          uint64_t node_id_b = strtoull(request->node_id_b().c_str(), nullptr, 10);
-          int status_code = graph->removeEdge(node_id_a, node_id_b);
-          if (status_code == 200) {
-            slog->add_log_entry(OP_REMOVE_EDGE, node_id_a, node_id_b);
-          }
-        }
-      }else {
-        //this is the last node in the chain
-        uint64_t node_id_a = strtoull(request->node_id_a().c_str(), nullptr, 10);
-        uint64_t node_id_b = strtoull(request->node_id_b().c_str(), nullptr, 10);
-        int status_code = graph->removeEdge(node_id_a, node_id_b);
-        if (status_code == 200) {
-          slog->add_log_entry(OP_REMOVE_EDGE, node_id_a, node_id_b);
-        }
-      }
+    }else if (code != 0) {
+      std::string prefix("Remove edge fail: rpc failed!");
+      reply->set_message(prefix);
+      return Status::CANCELLED;
     }
     std::string prefix("Successfully removed edge: ");
     reply->set_message(prefix + request->node_id_a() + "," + request->node_id_b());
     return Status::OK;
   }
 
+  Status SendBatch(ServerContext* context, const BatchRequest* request,
+      BatchReply* reply) override {
+    std::vector<log_entry_t> ops;
+    for (const Operation& op : request->operations()) {
+      ops.push_back(log_entry_t(op.opcode(), op.node_id_a(), op.node_id_b()));
+    }
+    std::vector<int> status;
+    int code = apply_ops(ops, &status);
+    if (code == 507) {
+      std::string prefix("Batch fail: log is full!");
+      reply->set_message(prefix);
+      return Status::CANCELLED;
+    }else if (code != 0) {
+      std::string prefix("Batch fail: rpc failed!");
+      reply->set_message(prefix);
+      return Status::CANCELLED;
+    }
+    for (int status_code : status) {
+      reply->add_status(status_code);
+    }
+    reply->set_message("Successfully applied batch: " + std::to_string(ops.size()) + " operations");
+    return Status::OK;
+  }
+
   public:
   struct Graph* graph = nullptr;
   server_log* slog = nullptr;
   rpcsenderClient* grpc_client = nullptr;
+  chainReplicator* replicator = nullptr;
+  std::mutex* write_mutex = nullptr;
 
   void bind_graph(struct Graph* g) {
     graph = g;
@@ -181,5 +152,181 @@ class rpcsenderServiceImpl final : public rpcsender::Service {
   void bind_grpc_client(rpcsenderClient* cli) {
     grpc_client = cli;
   }
+
+  void bind_replicator(chainReplicator* r) {
+    replicator = r;
+  }
+
+  void bind_write_mutex(std::mutex* m) {
+    write_mutex = m;
+  }
+
+  //forward ops to the rest of the chain, then apply and log them here and
+  //wait until they are durable. return 0, 507 if the log is full or 500 if
+  //the next node or the log write failed. status (if not null) gets one
+  //status code per op
+  int apply_ops(const std::vector<log_entry_t>& ops, std::vector<int>* status) {
+    std::unique_lock<std::mutex> wl(*write_mutex);
+    if (!slog->reserve_log(ops.size())) {
+      return 507;
+    }
+    if (grpc_client != nullptr and !grpc_client->Forward(ops)) {
+      return 500;
+    }
+    uint64_t lsn = apply_and_log(ops, status);
+    //wait for group commit without blocking the next mutation
+    wl.unlock();
+    return slog->wait_durable(lsn) ? 0 : 500;
+  }
+
+  //apply ops in order and log the successful ones, return the lsn to wait
+  //for (0 if nothing was logged). called with the write mutex held
+  uint64_t apply_and_log(const std::vector<log_entry_t>& ops, std::vector<int>* status) {
+    std::vector<log_entry_t> applied;
+    graph_write_guard wg(graph);
+    for (const log_entry_t& op : ops) {
+      int status_code = graph->applyOperation(op.opcode, op.node1, op.node2);
+      if (status != nullptr) {
+        status->push_back(status_code);
+      }
+      if (status_code == 200) {
+        applied.push_back(op);
+      }
+    }
+    return applied.empty() ? 0 : slog->add_log_entries(applied);
+  }
+};
+
+// rpcsenderV2: the same mutations with numeric ids and replies, sharing the
+// graph, log and next node of the v1 service.
+class rpcsenderV2ServiceImpl final : public rpcsenderV2::Service {
+  Status Apply(ServerContext* context, const OpsV2* request,
+      ReplyV2* reply) override {
+    std::vector<log_entry_t> ops;
+    if (!ops_from_v2(*request, &ops)) {
+      return Status(grpc::StatusCode::INVALID_ARGUMENT, "operation arrays differ in length");
+    }
+    std::vector<int> status;
+    int code = v1->apply_ops(ops, &status);
+    reply->set_seq(request->seq());
+    reply->set_code(code);
+    reply->mutable_status()->Reserve(status.size());
+    for (int status_code : status) {
+      reply->add_status(status_code);
+    }
+    return Status::OK;
+  }
+
+  //pipelined replication: requests are applied and forwarded in stream order
+  //as they arrive, a second thread acks them upstream in the same order once
+  //they are durable here and acked by the next node
+  Status Replicate(ServerContext* context,
+      ServerReaderWriter<ReplyV2, OpsV2>* stream) override {
+    struct pending_ack {
+      uint64_t seq;
+      uint64_t lsn;
+      uint64_t next_seq;
+    };
+    std::deque<pending_ack> acks;
+    std::mutex ack_mutex;
+    std::condition_variable ack_cv;
+    bool reading = true;
+    chainReplicator* replicator = v1->replicator;
+
+    std::thread acker([&]() {
+      while (true) {
+        pending_ack a;
+        {
+          std::unique_lock<std::mutex> lk(ack_mutex);
+          ack_cv.wait(lk, [&]() { return !acks.empty() or !reading; });
+          if (acks.empty()) {
+            return;
+          }
+          a = acks.front();
+          acks.pop_front();
+        }
+        if (!v1->slog->wait_durable(a.lsn)) {
+          //the log lost the request, fail the upstream stream
+          context->TryCancel();
+          return;
+        }
+        if (a.next_seq != 0 and !replicator->WaitAcked(a.next_seq)) {
+          //the rest of the chain lost the request, fail the upstream stream
+          context->TryCancel();
+          return;
+        }
+        ReplyV2 ack;
+        ack.set_seq(a.seq);
+        if (!stream->Write(ack)) {
+          return;
+        }
+      }
+    });
+
+    //requests of the same epoch up to applied_seq were already applied on
+    //an earlier stream, the upstream node resends them after a failure
+    uint64_t epoch = 0;
+    auto md = context->client_metadata().find("chain-epoch");
+    if (md != context->client_metadata().end()) {
+      epoch = strtoull(std::string(md->second.data(), md->second.size()).c_str(), nullptr, 10);
+    }
+
+    OpsV2 request;
+    while (stream->Read(&request)) {
+      std::vector<log_entry_t> ops;
+      pending_ack a = {request.seq(), 0, 0};
+      if (!ops_from_v2(request, &ops)) {
+        context->TryCancel();
+        break;
+      }
+      {
+        std::lock_guard<std::mutex> wl(*v1->write_mutex);
+        if (epoch == 0 or epoch != upstream_epoch) {
+          upstream_epoch = epoch;
+          applied_seq = 0;
+        }
+        if (request.seq() <= applied_seq) {
+          //ack the duplicate once everything logged and streamed on so far is
+          a.lsn = v1->slog->get_appended_lsn();
+          a.next_seq = replicator != nullptr ? replicator->LastSent() : 0;
+        }else {
+          if (!v1->slog->reserve_log(ops.size())) {
+            context->TryCancel();
+            break;
+          }
+          if (replicator != nullptr) {
+            a.next_seq = replicator->Send(ops);
+          }else if (v1->grpc_client != nullptr and !v1->grpc_client->Forward(ops)) {
+            context->TryCancel();
+            break;
+          }
+          a.lsn = v1->apply_and_log(ops, nullptr);
+          applied_seq = request.seq();
+        }
+      }
+      {
+        std::lock_guard<std::mutex> lk(ack_mutex);
+        acks.push_back(a);
+      }
+      ack_cv.notify_one();
+    }
+    {
+      std::lock_guard<std::mutex> lk(ack_mutex);
+      reading = false;
+    }
+    ack_cv.notify_one();
+    acker.join();
+    return Status::OK;
+  }
+
+  public:
+  rpcsenderV2ServiceImpl(rpcsenderServiceImpl* v1_service) : v1(v1_service) {}
+
+  private:
+  rpcsenderServiceImpl* v1;
+  //epoch of the upstream replicator and the last sequence number of it
+  //applied here, guarded by the write mutex
+  uint64_t upstream_epoch = 0;
+  uint64_t applied_seq = 0;
 };
 #endif
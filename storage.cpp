@@ -0,0 +1,479 @@
+#include "storage.hpp"
+
+#include <string>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <linux/falloc.h>
+#include "debug.hpp"
+#include "types.hpp"
+
+device_storage::~device_storage() {
+  close();
+}
+
+int device_storage::io_mode() {
+  return io;
+}
+
+bool device_storage::open(const std::string& path) {
+  fd = ::open(path.c_str(), O_RDWR);
+  if (fd < 0) {
+    debug_error("Open log disk failed.");
+    return false;
+  }
+  //seeking to the end gives the size of both block devices and regular files
+  off_t end = lseek(fd, 0, SEEK_END);
+  size_t size = end > 0 ? (size_t)end : 0;
+  blocks = size / BLOCK_SIZE;
+  if (io == LOG_IO_DIRECT) {
+    open_direct(path);
+    return true;
+  }
+  if (io != LOG_IO_MMAP) {
+    return true;
+  }
+  //map the superblock, log and checkpoint regions once for the whole run
+  void* addr = size == 0 ? MAP_FAILED : mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (addr == MAP_FAILED) {
+    debug_warn("Map log disk failed. Fall back to pwrite.");
+    io = LOG_IO_PWRITE;
+    return true;
+  }
+  map = (char*)addr;
+  map_size = size;
+  return true;
+}
+
+void device_storage::open_direct(const std::string& path) {
+  //a direct write invalidates the cached pages it overwrites
+  direct_fd = ::open(path.c_str(), O_RDWR | O_DIRECT);
+  if (direct_fd < 0) {
+    debug_warn("Open log disk with O_DIRECT failed. Fall back to pwrite.");
+    io = LOG_IO_PWRITE;
+    return;
+  }
+  //a device taking O_DIRECT reads of a sector takes such writes too
+  void* probe = nullptr;
+  if (posix_memalign(&probe, BLOCK_SIZE, BLOCK_SIZE) == 0) {
+    direct_sector = pread(direct_fd, probe, SECTOR_SIZE, 0) == SECTOR_SIZE ? SECTOR_SIZE : BLOCK_SIZE;
+    free(probe);
+  }
+  if (!ring.init(DIRECT_QUEUE_DEPTH)) {
+    debug_warn("io_uring is not available. Direct writes are synchronous.");
+  }
+}
+
+uint64_t device_storage::size_blocks() {
+  return blocks;
+}
+
+void device_storage::read_blocks(void* buf, uint32_t offset, uint32_t n) {
+  off_t pos = (off_t)offset * BLOCK_SIZE;
+  size_t len = (size_t)n * BLOCK_SIZE;
+  switch (io) {
+    case LOG_IO_MMAP:
+      memcpy(buf, map + pos, len);
+      break;
+    case LOG_IO_PWRITE:
+    case LOG_IO_DIRECT:
+      if (pread(fd, buf, len, pos) != (ssize_t)len) {
+        //blocks past the end of the device read as invalid
+        memset(buf, 0, len);
+        if (pread(fd, buf, len, pos) < 0) {
+          debug_error("Read log blocks failed.");
+        }
+      }
+      break;
+    default: {
+      void* addr = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, pos);
+      if (addr == MAP_FAILED) {
+        memset(buf, 0, len);
+        break;
+      }
+      memcpy(buf, addr, len);
+      munmap(addr, len);
+      break;
+    }
+  }
+}
+
+void device_storage::prefetch_blocks(uint32_t offset, uint32_t n) {
+  if (blocks > 0 && offset + (uint64_t)n > blocks) {
+    n = offset < blocks ? (uint32_t)(blocks - offset) : 0;
+  }
+  if (n == 0) {
+    return;
+  }
+  off_t pos = (off_t)offset * BLOCK_SIZE;
+  size_t len = (size_t)n * BLOCK_SIZE;
+  if (io == LOG_IO_MMAP) {
+    madvise(map + pos, len, MADV_WILLNEED);
+  }else {
+    posix_fadvise(fd, pos, len, POSIX_FADV_WILLNEED);
+  }
+}
+
+//-errno of a failed call, a short write returned n >= 0 without an errno.
+//the caller logs it, a checkpoint process writing blocks must not
+static int write_failed(ssize_t n) {
+  return n < 0 && errno != 0 ? -errno : -EIO;
+}
+
+int device_storage::write_block(const void* buf, uint32_t offset) {
+  off_t pos = (off_t)offset * BLOCK_SIZE;
+  switch (io) {
+    case LOG_IO_MMAP:
+      memcpy(map + pos, buf, BLOCK_SIZE);
+      if (msync(map + pos, BLOCK_SIZE, MS_SYNC) != 0) {
+        return write_failed(-1);
+      }
+      return 0;
+    case LOG_IO_PWRITE: {
+      ssize_t n = pwrite(fd, buf, BLOCK_SIZE, pos);
+      if (n != BLOCK_SIZE) {
+        return write_failed(n);
+      }
+      if (fdatasync(fd) != 0) {
+        return write_failed(-1);
+      }
+      return 0;
+    }
+    case LOG_IO_DIRECT: {
+      uint32_t from = 0;
+      uint32_t to = BLOCK_SIZE;
+      return write_ranges(buf, offset, 1, &from, &to);
+    }
+    default: {
+      void* addr = mmap(NULL, BLOCK_SIZE, PROT_WRITE, MAP_SHARED, fd, pos);
+      if (addr == MAP_FAILED) {
+        return write_failed(-1);
+      }
+      memcpy(addr, buf, BLOCK_SIZE);
+      int res = msync(addr, BLOCK_SIZE, MS_SYNC) != 0 ? write_failed(-1) : 0;
+      munmap(addr, BLOCK_SIZE);
+      return res;
+    }
+  }
+}
+
+uint32_t device_storage::write_granularity() {
+  return io == LOG_IO_DIRECT ? direct_sector : BLOCK_SIZE;
+}
+
+int device_storage::write_ranges(const void* buf, uint32_t offset, uint32_t n, const uint32_t* from, const uint32_t* to) {
+  if (io != LOG_IO_DIRECT) {
+    return write_block(buf, offset);
+  }
+  //O_DIRECT transfers need an aligned buffer
+  alignas(BLOCK_SIZE) char aligned[BLOCK_SIZE];
+  memcpy(aligned, buf, BLOCK_SIZE);
+  off_t pos = (off_t)offset * BLOCK_SIZE;
+  for (uint32_t k = 0; k < n; ++k) {
+    ssize_t len = to[k] - from[k];
+    ssize_t written = pwrite(direct_fd, aligned + from[k], len, pos + from[k]);
+    if (written != len) {
+      return write_failed(written);
+    }
+    if (fdatasync(direct_fd) != 0) {
+      return write_failed(-1);
+    }
+  }
+  return 0;
+}
+
+bool device_storage::async_writes() {
+  return ring.ready();
+}
+
+bool device_storage::submit_write(const void* buf, uint32_t offset, uint32_t from, uint32_t to,
+    uint64_t tag, bool barrier) {
+  off_t pos = (off_t)offset * BLOCK_SIZE + from;
+  return ring.write(direct_fd, (const char*)buf + from, to - from, pos, tag, barrier);
+}
+
+bool device_storage::wait_write(uint64_t* tag, int32_t* res) {
+  return ring.wait(tag, res);
+}
+
+void device_storage::post_completion(uint64_t tag) {
+  ring.nop(tag);
+}
+
+void device_storage::close() {
+  ring.close();
+  if (direct_fd >= 0) {
+    ::close(direct_fd);
+    direct_fd = -1;
+  }
+  if (map != nullptr) {
+    munmap(map, map_size);
+    map = nullptr;
+  }
+  if (fd >= 0) {
+    ::close(fd);
+    fd = -1;
+  }
+}
+
+//segments the 32 bit block numbers reach
+static const uint32_t MAX_SEGMENTS = (uint32_t)((1ULL << 32) / SEGMENT_BLOCKS);
+
+segment_storage::segment_storage() : fds(new std::atomic<int>[MAX_SEGMENTS]) {
+  for (uint32_t i = 0; i < MAX_SEGMENTS; ++i) {
+    fds[i].store(-1);
+  }
+}
+
+segment_storage::~segment_storage() {
+  close();
+}
+
+std::string segment_storage::segment_name(const char* prefix, uint32_t seg) {
+  return dir + "/" + prefix + std::to_string(seg);
+}
+
+bool segment_storage::open(const std::string& path) {
+  dir = path;
+  if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+    debug_error("Create log directory failed.");
+    return false;
+  }
+  DIR* d = opendir(dir.c_str());
+  if (d == nullptr) {
+    debug_error("Log directory is not a directory.");
+    return false;
+  }
+  //open the segments so releases find them, and pick up the free ones
+  std::lock_guard<std::mutex> lk(fds_mutex);
+  struct dirent* e;
+  while ((e = readdir(d)) != nullptr) {
+    unsigned long seg;
+    char rest;
+    if (sscanf(e->d_name, "seg.%lu%c", &seg, &rest) == 1 && seg < MAX_SEGMENTS) {
+      int f = ::open(segment_name("seg.", seg).c_str(), O_RDWR);
+      if (f >= 0) {
+        fds[seg].store(f);
+      }
+    }else if (sscanf(e->d_name, "free.%lu%c", &seg, &rest) == 1 && seg < MAX_SEGMENTS) {
+      free_segments.push_back(seg);
+    }
+  }
+  closedir(d);
+  return true;
+}
+
+int segment_storage::segment_fd(uint32_t seg, bool create) {
+  int f = fds[seg].load();
+  if (f >= 0) {
+    return f;
+  }
+  std::lock_guard<std::mutex> lk(fds_mutex);
+  f = fds[seg].load();
+  if (f >= 0) {
+    return f;
+  }
+  //a file another process created
+  f = ::open(segment_name("seg.", seg).c_str(), O_RDWR);
+  if (f < 0 && create) {
+    f = create_segment_locked(seg);
+  }
+  if (f >= 0) {
+    fds[seg].store(f);
+  }
+  return f;
+}
+
+int segment_storage::create_segment_locked(uint32_t seg) {
+  std::string name = segment_name("seg.", seg);
+  int f = -1;
+  while (f < 0 && !free_segments.empty()) {
+    uint32_t n = free_segments.back();
+    free_segments.pop_back();
+    if (rename(segment_name("free.", n).c_str(), name.c_str()) == 0) {
+      f = ::open(name.c_str(), O_RDWR);
+    }
+  }
+  if (f < 0) {
+    f = ::open(name.c_str(), O_RDWR | O_CREAT, 0644);
+    if (f < 0) {
+      return -1;
+    }
+    //allocate the whole segment up front, a block write then never
+    //extends the file and its sync has no size change to commit
+    off_t size = (off_t)SEGMENT_BLOCKS * BLOCK_SIZE;
+    if (fallocate(f, 0, 0, size) != 0 && ftruncate(f, size) != 0) {
+      debug_warn("Size segment file failed.");
+    }
+    fsync(f);
+  }
+  //make the name durable before any block in the file is
+  int d = ::open(dir.c_str(), O_RDONLY);
+  if (d >= 0) {
+    fsync(d);
+    ::close(d);
+  }
+  return f;
+}
+
+void segment_storage::recycle_segment_locked(uint32_t seg) {
+  int f = fds[seg].exchange(-1);
+  std::string name = segment_name("seg.", seg);
+  off_t size = (off_t)SEGMENT_BLOCKS * BLOCK_SIZE;
+  bool keep = f >= 0 && free_segments.size() < SEGMENT_RECYCLE
+      && std::find(free_segments.begin(), free_segments.end(), seg) == free_segments.end();
+  //a reused segment may follow the head of the log, where blocks of the
+  //current generation must not show up. zeroing keeps the allocation
+  if (keep) {
+    keep = (fallocate(f, FALLOC_FL_ZERO_RANGE, 0, size) == 0
+        || (fallocate(f, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, size) == 0
+        && fallocate(f, 0, 0, size) == 0)) && fdatasync(f) == 0;
+  }
+  if (f >= 0) {
+    ::close(f);
+  }
+  if (keep && rename(name.c_str(), segment_name("free.", seg).c_str()) == 0) {
+    free_segments.push_back(seg);
+    return;
+  }
+  unlink(name.c_str());
+}
+
+uint64_t segment_storage::size_blocks() {
+  return 0;
+}
+
+uint32_t segment_storage::log_size() {
+  return SEGMENT_LOG_SIZE;
+}
+
+void segment_storage::read_blocks(void* buf, uint32_t offset, uint32_t n) {
+  char* p = (char*)buf;
+  while (n > 0) {
+    uint32_t seg = offset / SEGMENT_BLOCKS;
+    uint32_t first = offset % SEGMENT_BLOCKS;
+    uint32_t k = std::min<uint32_t>(n, SEGMENT_BLOCKS - first);
+    size_t len = (size_t)k * BLOCK_SIZE;
+    int f = segment_fd(seg, false);
+    ssize_t got = f < 0 ? 0 : pread(f, p, len, (off_t)first * BLOCK_SIZE);
+    if (got < (ssize_t)len) {
+      //missing segments and blocks past the end read as invalid
+      memset(p + (got > 0 ? got : 0), 0, len - (got > 0 ? got : 0));
+    }
+    p += len;
+    offset += k;
+    n -= k;
+  }
+}
+
+void segment_storage::prefetch_blocks(uint32_t offset, uint32_t n) {
+  while (n > 0) {
+    uint32_t seg = offset / SEGMENT_BLOCKS;
+    uint32_t first = offset % SEGMENT_BLOCKS;
+    uint32_t k = std::min<uint32_t>(n, SEGMENT_BLOCKS - first);
+    int f = segment_fd(seg, false);
+    if (f >= 0) {
+      posix_fadvise(f, (off_t)first * BLOCK_SIZE, (off_t)k * BLOCK_SIZE, POSIX_FADV_WILLNEED);
+    }
+    offset += k;
+    n -= k;
+  }
+}
+
+int segment_storage::write_block(const void* buf, uint32_t offset) {
+  int f = segment_fd(offset / SEGMENT_BLOCKS, true);
+  if (f < 0) {
+    return write_failed(-1);
+  }
+  ssize_t n = pwrite(f, buf, BLOCK_SIZE, (off_t)(offset % SEGMENT_BLOCKS) * BLOCK_SIZE);
+  if (n != BLOCK_SIZE) {
+    return write_failed(n);
+  }
+  if (fdatasync(f) != 0) {
+    return write_failed(-1);
+  }
+  return 0;
+}
+
+bool segment_storage::reserve_blocks(uint32_t offset, uint32_t n) {
+  uint64_t end = (uint64_t)offset + n;
+  for (uint64_t seg = offset / SEGMENT_BLOCKS; seg * SEGMENT_BLOCKS < end; ++seg) {
+    if (segment_fd((uint32_t)seg, true) < 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void segment_storage::release_blocks(uint32_t offset, uint32_t n) {
+  //only whole segments go, which never includes the super block
+  uint64_t first = ((uint64_t)offset + SEGMENT_BLOCKS - 1) / SEGMENT_BLOCKS;
+  uint64_t last = ((uint64_t)offset + n) / SEGMENT_BLOCKS;
+  std::lock_guard<std::mutex> lk(fds_mutex);
+  for (uint64_t seg = first; seg < last; ++seg) {
+    if (fds[seg].load() >= 0) {
+      recycle_segment_locked((uint32_t)seg);
+    }
+  }
+}
+
+void segment_storage::close() {
+  std::lock_guard<std::mutex> lk(fds_mutex);
+  for (uint32_t i = 0; i < MAX_SEGMENTS; ++i) {
+    int f = fds[i].exchange(-1);
+    if (f >= 0) {
+      ::close(f);
+    }
+  }
+}
+
+memory_storage::~memory_storage() {
+  close();
+}
+
+bool memory_storage::open(const std::string& path) {
+  void* addr = mmap(NULL, blocks * BLOCK_SIZE, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (addr == MAP_FAILED) {
+    debug_error("Map log memory failed.");
+    return false;
+  }
+  map = (char*)addr;
+  return true;
+}
+
+uint64_t memory_storage::size_blocks() {
+  return blocks;
+}
+
+void memory_storage::read_blocks(void* buf, uint32_t offset, uint32_t n) {
+  uint32_t k = offset >= blocks ? 0 : (uint32_t)std::min<uint64_t>(n, blocks - offset);
+  if (k > 0) {
+    memcpy(buf, map + (size_t)offset * BLOCK_SIZE, (size_t)k * BLOCK_SIZE);
+  }
+  memset((char*)buf + (size_t)k * BLOCK_SIZE, 0, (size_t)(n - k) * BLOCK_SIZE);
+}
+
+int memory_storage::write_block(const void* buf, uint32_t offset) {
+  if (offset >= blocks) {
+    //past the end of the memory
+    return -ENOSPC;
+  }
+  memcpy(map + (size_t)offset * BLOCK_SIZE, buf, BLOCK_SIZE);
+  return 0;
+}
+
+void memory_storage::close() {
+  if (map != nullptr) {
+    munmap(map, blocks * BLOCK_SIZE);
+    map = nullptr;
+  }
+}
@@ -0,0 +1,196 @@
+#ifndef _STORAGE_H
+#define _STORAGE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include "io_ring.hpp"
+#include "types.hpp"
+
+//where the blocks of a log live. server_log addresses them by block number:
+//block 0 is the super block, [1, log_size) the log ring and the checkpoint
+//images start at log_size, see super_block_t. blocks never written read
+//back as zeros
+class log_storage {
+  public:
+    virtual ~log_storage() {}
+
+    //open the storage at path, false if it can't be used
+    virtual bool open(const std::string& path) = 0;
+
+    //blocks the storage has room for, 0 if it grows as it is written
+    virtual uint64_t size_blocks() = 0;
+
+    //log_size of the super block when the storage is formatted
+    virtual uint32_t log_size() {
+      return LOG_SEG_SIZE;
+    }
+
+    //read n consecutive blocks in one go
+    virtual void read_blocks(void* buf, uint32_t offset, uint32_t n) = 0;
+
+    //ask for n blocks at offset to be read ahead of time
+    virtual void prefetch_blocks(uint32_t offset, uint32_t n) {}
+
+    //write a block and make it durable, return 0 or -errno
+    virtual int write_block(const void* buf, uint32_t offset) = 0;
+
+    //get n blocks at offset ready to be written, before a forked process
+    //writes them. return false if some can't be
+    virtual bool reserve_blocks(uint32_t offset, uint32_t n) { return true; }
+
+    //n blocks at offset are not needed anymore. the storage may drop them,
+    //they read back as zeros or as they were
+    virtual void release_blocks(uint32_t offset, uint32_t n) {}
+
+    //smallest write the storage takes, write_ranges below BLOCK_SIZE only
+    //writes the given bytes
+    virtual uint32_t write_granularity() {
+      return BLOCK_SIZE;
+    }
+
+    //write n byte ranges [from, to) of a block and make them durable, each
+    //one before the next. the rest of the block on the storage must equal
+    //buf already. return 0 or -errno, ranges after a failed one aren't
+    //written
+    virtual int write_ranges(const void* buf, uint32_t offset, uint32_t n, const uint32_t* from, const uint32_t* to) {
+      return write_block(buf, offset);
+    }
+
+    //asynchronous writes: submit_write queues a durable write of bytes
+    //[from, to) of buf, a BLOCK_SIZE aligned copy of a block that must stay
+    //valid until it completed, and wait_write returns completions. a
+    //barrier write starts after every earlier one completed. only one
+    //thread submits and one thread waits at a time
+    virtual bool async_writes() {
+      return false;
+    }
+
+    //false if the write could not be queued
+    virtual bool submit_write(const void* buf, uint32_t offset, uint32_t from, uint32_t to,
+        uint64_t tag, bool barrier) {
+      return false;
+    }
+
+    //block until a write completes, return its tag and the bytes written
+    //or -errno. false if there are no asynchronous writes
+    virtual bool wait_write(uint64_t* tag, int32_t* res) {
+      return false;
+    }
+
+    //complete a request with tag right away, to wake up wait_write
+    virtual void post_completion(uint64_t tag) {}
+
+    virtual void close() = 0;
+};
+
+//a block device or a regular file holding the whole layout, accessed in
+//one of the LOG_IO_* modes
+class device_storage : public log_storage {
+  private:
+    int io;
+    int fd = -1;
+    uint64_t blocks = 0;
+    //whole device mapping for LOG_IO_MMAP
+    char* map = nullptr;
+    size_t map_size = 0;
+    //LOG_IO_DIRECT: the device opened again with O_DIRECT for the writes,
+    //reads keep going through the page cache on fd
+    int direct_fd = -1;
+    io_ring ring;
+    //smallest O_DIRECT write the device takes, SECTOR_SIZE or BLOCK_SIZE
+    uint32_t direct_sector = BLOCK_SIZE;
+
+    //open direct_fd and the ring, fall back to LOG_IO_PWRITE
+    void open_direct(const std::string& path);
+
+  public:
+    device_storage(int log_io) : io(log_io) {}
+
+    ~device_storage();
+
+    //LOG_IO_* in use, the requested one unless it is not available
+    int io_mode();
+
+    bool open(const std::string& path);
+    uint64_t size_blocks();
+    void read_blocks(void* buf, uint32_t offset, uint32_t n);
+    void prefetch_blocks(uint32_t offset, uint32_t n);
+    int write_block(const void* buf, uint32_t offset);
+    uint32_t write_granularity();
+    int write_ranges(const void* buf, uint32_t offset, uint32_t n, const uint32_t* from, const uint32_t* to);
+    bool async_writes();
+    bool submit_write(const void* buf, uint32_t offset, uint32_t from, uint32_t to, uint64_t tag, bool barrier);
+    bool wait_write(uint64_t* tag, int32_t* res);
+    void post_completion(uint64_t tag);
+    void close();
+};
+
+//a directory of segment files of SEGMENT_BLOCKS blocks each, seg.N holding
+//blocks [N * SEGMENT_BLOCKS, (N + 1) * SEGMENT_BLOCKS). a segment file is
+//preallocated when a block of it is first written, so the log grows with
+//what it holds. released segments are zeroed and kept as free.N to be
+//renamed into the next segment the log needs
+class segment_storage : public log_storage {
+  private:
+    std::string dir;
+    //fds of the segment files opened so far, -1 if not open. read without
+    //a lock, so a forked process never waits for fds_mutex held by a
+    //thread that doesn't exist in it
+    std::unique_ptr<std::atomic<int>[]> fds;
+    //creating, recycling and closing segment files
+    std::mutex fds_mutex;
+    //numbers N of the zeroed free.N files
+    std::vector<uint32_t> free_segments;
+
+    std::string segment_name(const char* prefix, uint32_t seg);
+
+    //fd of segment seg, creating the file if create, -1 if there is none
+    int segment_fd(uint32_t seg, bool create);
+
+    //a preallocated file for segment seg, recycled if there is one
+    int create_segment_locked(uint32_t seg);
+
+    //zero segment seg and keep it for reuse, or delete it
+    void recycle_segment_locked(uint32_t seg);
+
+  public:
+    segment_storage();
+
+    ~segment_storage();
+
+    bool open(const std::string& path);
+    uint64_t size_blocks();
+    uint32_t log_size();
+    void read_blocks(void* buf, uint32_t offset, uint32_t n);
+    void prefetch_blocks(uint32_t offset, uint32_t n);
+    int write_block(const void* buf, uint32_t offset);
+    bool reserve_blocks(uint32_t offset, uint32_t n);
+    void release_blocks(uint32_t offset, uint32_t n);
+    void close();
+};
+
+//blocks in memory, nothing survives the process. for tests and benchmarks
+//of everything above the disk. the memory is a shared mapping, so the
+//background checkpoint process writes into the same blocks
+class memory_storage : public log_storage {
+  private:
+    uint64_t blocks;
+    char* map = nullptr;
+
+  public:
+    memory_storage(uint64_t n = MEMORY_STORAGE_BLOCKS) : blocks(n) {}
+
+    ~memory_storage();
+
+    bool open(const std::string& path);
+    uint64_t size_blocks();
+    void read_blocks(void* buf, uint32_t offset, uint32_t n);
+    int write_block(const void* buf, uint32_t offset);
+    void close();
+};
+
+#endif
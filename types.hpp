@@ -3,14 +3,120 @@
 
 #define BLOCK_SIZE 4096
 #define LOG_SEG_SIZE 500000
+//log blocks recovery reads at once, the next chunk is read ahead meanwhile
+#define LOG_READAHEAD_BLOCKS 1024
+//runs of log entries between node removals shorter than this are replayed
+//on the recovering thread, longer ones by vertex-partitioned threads
+#define REPLAY_PARALLEL_MIN 4096
 
 #define CHECKSUM_OFFSET 100
 
+//checksum of super and log blocks, recorded in their header
+//CHECKSUM_XOR: xor of the 64-bit words after the checksum, plus
+//  CHECKSUM_OFFSET. blocks written before the type was recorded carry 0
+//CHECKSUM_CRC32C: crc32c of either half of the bytes after the checksum
+#define CHECKSUM_XOR 0
+#define CHECKSUM_CRC32C 1
+
 #define OP_ADD_NODE 0
 #define OP_ADD_EDGE 1
 #define OP_REMOVE_NODE 2
 #define OP_REMOVE_EDGE 3
 
-#define DEBUG 1
+//kind of a checkpoint block, in the pairs format every entry of a block is a
+//<node1, node2> pair
+//CHECKPT_BASE: <node, node> adds a node, <node1, node2> an undirected edge
+//CHECKPT_DELTA: <node, node> sets a node with no neighbors, the following
+//  <node, neighbor> pairs add its neighbors one direction at a time
+//CHECKPT_TOMBSTONE: <node, node> removes a node
+#define CHECKPT_BASE 0
+#define CHECKPT_DELTA 1
+#define CHECKPT_TOMBSTONE 2
+
+//encoding of a checkpoint image, recorded in the super block
+//CHECKPT_FORMAT_PAIRS: blocks of <node1, node2> pairs as above
+//CHECKPT_FORMAT_VARINT: blocks of vertex records with sorted, delta and
+//  varint encoded neighbors (see checkpt_block_t). a CHECKPT_BASE record
+//  holds the larger neighbors only, a CHECKPT_DELTA record all of them
+#define CHECKPT_FORMAT_PAIRS 1
+#define CHECKPT_FORMAT_VARINT 2
+
+//encoding of the entries of a log block, recorded in its header
+//LOG_FORMAT_FIXED: 170 log_entry_t of 24 bytes
+//LOG_FORMAT_VARINT: an opcode byte and varint node ids, see log_block_t
+#define LOG_FORMAT_FIXED 1
+#define LOG_FORMAT_VARINT 2
+
+//how log blocks are read from and written to the log device
+//LOG_IO_MMAP_BLOCK: mmap + msync + munmap a single block per access
+//LOG_IO_MMAP: map the whole device once at attach time, msync per write
+//LOG_IO_PWRITE: pread/pwrite + fdatasync
+//LOG_IO_DIRECT: O_DIRECT writes with RWF_DSYNC through io_uring, several
+//log blocks in flight and completed asynchronously, reads as LOG_IO_PWRITE
+#define LOG_IO_MMAP_BLOCK 0
+#define LOG_IO_MMAP 1
+#define LOG_IO_PWRITE 2
+#define LOG_IO_DIRECT 3
+
+//log block writes LOG_IO_DIRECT keeps in flight
+#define DIRECT_QUEUE_DEPTH 64
+
+//smallest write LOG_IO_DIRECT issues when the device takes O_DIRECT
+//transfers of that size, a partly filled log block is rewritten in sectors
+#define SECTOR_SIZE 512
+
+//milliseconds before a broken replication stream to the next node is
+//reopened to resend the mutations it hasn't acked
+#define CHAIN_RETRY_MS 100
+
+//where server_log keeps its blocks, see storage.hpp
+//STORAGE_DEVICE: the whole layout in DEVFILE, a block device or a file
+//STORAGE_SEGMENTS: files of SEGMENT_BLOCKS blocks in the directory DEVFILE
+//STORAGE_MEMORY: MEMORY_STORAGE_BLOCKS blocks in memory, lost on exit
+#define STORAGE_DEVICE 0
+#define STORAGE_SEGMENTS 1
+#define STORAGE_MEMORY 2
+//64 MB segment files
+#define SEGMENT_BLOCKS 16384
+//log ring of a segmented log, far more than it ever holds: segments are
+//created as the log grows and recycled once a checkpoint truncated them
+#define SEGMENT_LOG_SIZE (1U << 31)
+//truncated segment files kept for reuse, more are deleted
+#define SEGMENT_RECYCLE 4
+#define MEMORY_STORAGE_BLOCKS (2 * LOG_SEG_SIZE)
+
+//levels of debug messages, see debug.hpp
+#define DEBUG_LEVEL_TRACE 0
+#define DEBUG_LEVEL_DEBUG 1
+#define DEBUG_LEVEL_INFO 2
+#define DEBUG_LEVEL_WARN 3
+#define DEBUG_LEVEL_ERROR 4
+#define DEBUG_LEVEL_OFF 5
+//messages below this level are compiled out
+#ifndef DEBUG_LEVEL
+#define DEBUG_LEVEL DEBUG_LEVEL_INFO
+#endif
+//debug messages queued for the writer thread, longer ones are cut
+#define DEBUG_RING_SIZE 4096
+#define DEBUG_MESSAGE_SIZE 128
+
+//adjacency backend of Graph:
+//1 = compact open-addressing vertex table with per-vertex neighbor arrays
+//0 = unordered_map<uint64_t, unordered_set<uint64_t> >
+#ifndef COMPACT_ADJACENCY
+#define COMPACT_ADJACENCY 1
+#endif
+
+//get_neighbors with "stream": true sends a chunked response of
+//NEIGHBOR_STREAM_CHUNK neighbors per chunk, the next one once the send
+//buffer of the connection is below NEIGHBOR_STREAM_LOW_WATER bytes
+#define NEIGHBOR_STREAM_CHUNK 65536
+#define NEIGHBOR_STREAM_LOW_WATER 65536
+
+//characters of a get_neighbors page cursor
+#define NEIGHBOR_CURSOR_LEN 24
+
+//seconds an idle keep-alive http connection stays open
+#define HTTP_KEEP_ALIVE_TIMEOUT 60
 
 #endif
@@ -1,12 +1,19 @@
 #ifndef _UTILITY_H
 #define _UTILITY_H
 
+#include <algorithm>
 #include <string>
 #include <sstream>
 #include <unordered_map>
 #include <vector>
+#include <cstring>
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
 #include "mongoose.h"
+#include "adjacency.hpp"
 #include "types.hpp"
+#include "checksum.hpp"
 
 using namespace std;
 
@@ -15,45 +22,423 @@ static unordered_map<int, string> status_code_mp = {
   {507, "Checkpoint Needed"}, {500, "Chain Replication Failed"}
 };
 
-//parse the command type from the uri
-static string get_command_type_from_uri(const char* uri) {
-  string str(uri);
-  size_t pos1 = str.find(' ');
-  str = str.substr(0, pos1);
-  size_t pos2 = str.find_last_of('/');
-  return str.substr(pos2 + 1);
+//parse the command type from the uri, the last segment of its path
+static string get_command_type_from_uri(const struct mg_str& uri) {
+  size_t pos = uri.len;
+  while (pos > 0 && uri.p[pos - 1] != '/') {
+    pos--;
+  }
+  return string(uri.p + pos, uri.len - pos);
+}
+
+//get the node id parameter key from tokens as stoull reads it, false if
+//it is missing or not a number
+static bool get_node_from_token(struct json_token* tokens, const char* key, uint64_t* id) {
+  struct json_token* tk = tokens == nullptr ? nullptr : find_json_token(tokens, key);
+  char buf[32];
+  if (tk == nullptr or (tk->type != JSON_TYPE_NUMBER and tk->type != JSON_TYPE_STRING)
+      or tk->len >= (int)sizeof(buf)) {
+    return false;
+  }
+  memcpy(buf, tk->ptr, tk->len);
+  buf[tk->len] = '\0';
+  char* end;
+  errno = 0;
+  *id = strtoull(buf, &end, 10);
+  return end != buf and errno == 0;
+}
+
+//node id parameters of a request, has_* is false if the key is missing.
+//get_neighbors also takes a page size limit, the cursor of the page and
+//stream: true for a chunked response. cursor_token is the cursor as sent,
+//it points into the request body, cursor the neighbor it decodes to once
+//decode_neighbor_cursor set valid_cursor
+struct request_ids_t {
+  uint64_t node_id = 0;
+  uint64_t node_a_id = 0;
+  uint64_t node_b_id = 0;
+  uint64_t limit = 0;
+  struct mg_str cursor_token = {nullptr, 0};
+  uint64_t cursor = 0;
+  bool has_node_id = false;
+  bool has_node_a_id = false;
+  bool has_node_b_id = false;
+  bool has_limit = false;
+  bool has_cursor = false;
+  bool valid_cursor = false;
+  bool has_stream = false;
+  bool stream = false;
+};
+
+//fill ids from the tokens of the general json parser
+static void get_ids_from_tokens(struct json_token* tokens, request_ids_t* ids) {
+  ids->has_node_id = get_node_from_token(tokens, "node_id", &ids->node_id);
+  ids->has_node_a_id = get_node_from_token(tokens, "node_a_id", &ids->node_a_id);
+  ids->has_node_b_id = get_node_from_token(tokens, "node_b_id", &ids->node_b_id);
+  ids->has_limit = get_node_from_token(tokens, "limit", &ids->limit);
+  struct json_token* tk = tokens == nullptr ? nullptr : find_json_token(tokens, "cursor");
+  ids->has_cursor = tk != nullptr;
+  if (tk != nullptr) {
+    ids->cursor_token.p = tk->ptr;
+    ids->cursor_token.len = tk->len;
+  }
+  tk = tokens == nullptr ? nullptr : find_json_token(tokens, "stream");
+  ids->has_stream = tk != nullptr;
+  ids->stream = tk != nullptr and tk->type == JSON_TYPE_TRUE;
+}
+
+//get_neighbors page cursors are opaque to clients: NEIGHBOR_CURSOR_LEN hex
+//digits of the neighbor the next page starts at, masked with a hash of the
+//node, and of a check of the two, so a cursor only works for its node.
+//write the cursor at p and return the end
+static char* encode_neighbor_cursor(char* p, uint64_t node, uint64_t from) {
+  static const char hex[] = "0123456789abcdef";
+  uint64_t mask = adj_hash(node);
+  uint64_t masked = from ^ mask;
+  uint32_t check = (uint32_t)(adj_hash(from + mask) >> 32);
+  for (int i = 0; i < 16; ++i) {
+    p[i] = hex[(masked >> (60 - 4 * i)) & 0xf];
+  }
+  for (int i = 0; i < 8; ++i) {
+    p[16 + i] = hex[(check >> (28 - 4 * i)) & 0xf];
+  }
+  return p + NEIGHBOR_CURSOR_LEN;
+}
+
+//read the cursor token of ids into ids->cursor, false if it isn't a cursor
+//of ids->node_id
+static bool decode_neighbor_cursor(request_ids_t* ids) {
+  const struct mg_str& token = ids->cursor_token;
+  ids->valid_cursor = false;
+  if (token.len != NEIGHBOR_CURSOR_LEN) {
+    return false;
+  }
+  uint64_t v[2] = {0, 0};
+  for (size_t i = 0; i < NEIGHBOR_CURSOR_LEN; ++i) {
+    char c = token.p[i];
+    uint64_t digit;
+    if (c >= '0' && c <= '9') {
+      digit = c - '0';
+    }else if (c >= 'a' && c <= 'f') {
+      digit = c - 'a' + 10;
+    }else {
+      return false;
+    }
+    v[i >= 16] = v[i >= 16] << 4 | digit;
+  }
+  uint64_t mask = adj_hash(ids->node_id);
+  uint64_t from = v[0] ^ mask;
+  if (v[1] != (uint32_t)(adj_hash(from + mask) >> 32)) {
+    return false;
+  }
+  ids->cursor = from;
+  ids->valid_cursor = true;
+  return true;
+}
+
+static const char* skip_json_space(const char* p, const char* end) {
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+    p++;
+  }
+  return p;
+}
+
+//read the node ids of a flat json object such as {"node_a_id": 1,
+//"node_b_id": 2} in one pass over body, without copying or allocating.
+//other members may hold strings, numbers, true, false or null. return false
+//for anything else, such as nested values or ids that aren't plain
+//unsigned integers, bare or in quotes, and leave those bodies to the
+//general parser
+static bool decode_request_ids(const char* p, size_t len, request_ids_t* ids) {
+  const char* end = p + len;
+  p = skip_json_space(p, end);
+  if (p == end || *p != '{') {
+    return false;
+  }
+  p = skip_json_space(p + 1, end);
+  if (p < end && *p == '}') {
+    return skip_json_space(p + 1, end) == end;
+  }
+  while (true) {
+    if (p == end || *p != '"') {
+      return false;
+    }
+    const char* key = ++p;
+    while (p < end && *p != '"') {
+      if (*p == '\\') {
+        return false;
+      }
+      p++;
+    }
+    if (p == end) {
+      return false;
+    }
+    size_t key_len = p - key;
+    p = skip_json_space(p + 1, end);
+    if (p == end || *p != ':') {
+      return false;
+    }
+    p = skip_json_space(p + 1, end);
+    if (p == end) {
+      return false;
+    }
+    uint64_t* id = nullptr;
+    bool* found = nullptr;
+    if (key_len == 7 && memcmp(key, "node_id", 7) == 0) {
+      id = &ids->node_id;
+      found = &ids->has_node_id;
+    }else if (key_len == 9 && memcmp(key, "node_a_id", 9) == 0) {
+      id = &ids->node_a_id;
+      found = &ids->has_node_a_id;
+    }else if (key_len == 9 && memcmp(key, "node_b_id", 9) == 0) {
+      id = &ids->node_b_id;
+      found = &ids->has_node_b_id;
+    }else if (key_len == 5 && memcmp(key, "limit", 5) == 0) {
+      id = &ids->limit;
+      found = &ids->has_limit;
+    }
+    const char* value = p;
+    if (id != nullptr) {
+      bool quoted = *p == '"';
+      if (quoted) {
+        p++;
+      }
+      if (p == end || *p < '0' || *p > '9') {
+        return false;
+      }
+      uint64_t value = 0;
+      while (p < end && *p >= '0' && *p <= '9') {
+        uint64_t digit = *p - '0';
+        if (value > (UINT64_MAX - digit) / 10) {
+          return false;
+        }
+        value = value * 10 + digit;
+        p++;
+      }
+      if (p < end && (*p == '.' || *p == 'e' || *p == 'E')) {
+        return false;
+      }
+      if (quoted) {
+        if (p == end || *p != '"') {
+          return false;
+        }
+        p++;
+      }
+      //the first of duplicate keys counts, as with find_json_token
+      if (!*found) {
+        *id = value;
+        *found = true;
+      }
+    }else if (*p == '"') {
+      for (p++; p < end && *p != '"'; p++) {
+        if (*p == '\\') {
+          p++;
+        }
+      }
+      if (p >= end) {
+        return false;
+      }
+      p++;
+    }else {
+      //a number or a literal
+      while (p < end && (isalnum((unsigned char)*p) || *p == '-' || *p == '+' || *p == '.')) {
+        p++;
+      }
+      if (p == value) {
+        return false;
+      }
+    }
+    if (key_len == 6 && memcmp(key, "cursor", 6) == 0 && !ids->has_cursor) {
+      //the cursor string without its quotes, anything else fails to decode
+      ids->has_cursor = true;
+      bool quoted = *value == '"';
+      ids->cursor_token.p = value + quoted;
+      ids->cursor_token.len = p - value - 2 * quoted;
+    }
+    if (key_len == 6 && memcmp(key, "stream", 6) == 0 && !ids->has_stream) {
+      ids->has_stream = true;
+      ids->stream = p - value == 4 && memcmp(value, "true", 4) == 0;
+    }
+    p = skip_json_space(p, end);
+    if (p < end && *p == ',') {
+      p = skip_json_space(p + 1, end);
+      continue;
+    }
+    if (p < end && *p == '}') {
+      return skip_json_space(p + 1, end) == end;
+    }
+    return false;
+  }
+}
+
+//decimal digits of v, from its bit length
+static int uint64_digits(uint64_t v) {
+  static const uint64_t powers[] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL, 100000000ULL,
+    1000000000ULL, 10000000000ULL, 100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+    100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL, 100000000000000000ULL,
+    1000000000000000000ULL, 10000000000000000000ULL
+  };
+  v |= 1;
+  //1233 / 4096 is just above log10(2)
+  int n = ((64 - __builtin_clzll(v)) * 1233) >> 12;
+  return n + 1 - (v < powers[n]);
+}
+
+//write v in decimal at p, two digits at a time, and return the end
+static char* format_uint64(char* p, uint64_t v) {
+  static const char digit_pairs[] =
+    "00010203040506070809101112131415161718192021222324"
+    "25262728293031323334353637383940414243444546474849"
+    "50515253545556575859606162636465666768697071727374"
+    "75767778798081828384858687888990919293949596979899";
+  char* end = p + uint64_digits(v);
+  char* q = end;
+  while (v >= 100) {
+    q -= 2;
+    memcpy(q, digit_pairs + 2 * (v % 100), 2);
+    v /= 100;
+  }
+  if (v >= 10) {
+    memcpy(q - 2, digit_pairs + 2 * v, 2);
+  }else {
+    q[-1] = '0' + v;
+  }
+  return end;
+}
+
+//whether the connection stays open after the response to hm: by default
+//for HTTP/1.1, on request for HTTP/1.0
+static bool http_keep_alive(struct http_message* hm) {
+  struct mg_str* hdr = mg_get_http_header(hm, "Connection");
+  if (mg_vcmp(&hm->proto, "HTTP/1.1") == 0) {
+    return hdr == nullptr || mg_vcasecmp(hdr, "close") != 0;
+  }
+  return hdr != nullptr && mg_vcasecmp(hdr, "keep-alive") == 0;
 }
 
-//get the node id parameters from token
-static uint64_t get_node_from_token(struct json_token* tokens, const char* key) {
-  struct json_token* tk = find_json_token(tokens, key);
-  uint64_t id = stoull(string(tk->ptr, tk->len));
-  return id;
+//append the status line and the Connection header of a response to out
+static void append_http_status(struct mbuf* out, int status_code, const string& status, bool keep_alive) {
+  char num[20];
+  mbuf_append(out, "HTTP/1.1 ", 9);
+  mbuf_append(out, num, format_uint64(num, status_code) - num);
+  mbuf_append(out, " ", 1);
+  mbuf_append(out, status.data(), status.size());
+  if (keep_alive) {
+    mbuf_append(out, "\r\nConnection: keep-alive", 24);
+  }else {
+    mbuf_append(out, "\r\nConnection: close", 19);
+  }
 }
 
-//generate result http header
-static string gen_result_http_header(int status_code, string status, size_t content_len) {
-  ostringstream oss;
-  oss << "HTTP/1.1 " << status_code << " " << status << "\r\n";
-  oss << "Content-Length: " << content_len << "\r\n";
-  oss << "Content-Type: application/json\r\n\r\n";
-  return oss.str();
+//append the result http header to out
+static void append_result_http_header(struct mbuf* out, int status_code, const string& status, size_t content_len,
+    bool keep_alive) {
+  char num[20];
+  append_http_status(out, status_code, status, keep_alive);
+  mbuf_append(out, "\r\nContent-Length: ", 18);
+  mbuf_append(out, num, format_uint64(num, content_len) - num);
+  mbuf_append(out, "\r\nContent-Type: application/json\r\n\r\n", 36);
 }
 
-//generate get neighbors json result
-static string gen_neighbor_json_result(uint64_t node, vector<uint64_t>& nodes) {
-  string json = "\"node_id\": " + to_string(node) + ",";
-  string neighbors;
-  for (int i = 0; i < (int)nodes.size(); ++i) {
-    neighbors.append(to_string(nodes[i]) + ",");
+//length of nodes as a comma separated list
+static size_t neighbor_list_size(const vector<uint64_t>& nodes) {
+  size_t size = 0;
+  for (uint64_t n : nodes) {
+    size += uint64_digits(n) + 1;
   }
-  if (!neighbors.empty()) {
-    neighbors.pop_back();
+  return nodes.empty() ? 0 : size - 1;
+}
+
+//write nodes as a comma separated list at p and return the end
+static char* write_neighbor_list(char* p, const vector<uint64_t>& nodes) {
+  for (size_t i = 0; i < nodes.size(); ++i) {
+    if (i > 0) {
+      *p++ = ',';
+    }
+    p = format_uint64(p, nodes[i]);
   }
-  neighbors = "[" + neighbors + "]";
-  json = json + "\"neighbors\": " + neighbors;
-  json = "{" + json + "}";
-  return json;
+  return p;
+}
+
+//length of the get_neighbors json result of node, next_cursor is null
+//unless it is a page followed by more
+static size_t neighbor_json_size(uint64_t node, const vector<uint64_t>& nodes, const uint64_t* next_cursor) {
+  size_t size = strlen("{\"node_id\": ,\"neighbors\": []}") + uint64_digits(node) + neighbor_list_size(nodes);
+  if (next_cursor != nullptr) {
+    size += strlen(",\"next_cursor\": \"\"") + NEIGHBOR_CURSOR_LEN;
+  }
+  return size;
+}
+
+//write the get_neighbors json result {"node_id": 1,"neighbors": [2,3]} at p,
+//which has room for neighbor_json_size bytes, and return the end. a page
+//followed by more ends with ,"next_cursor": "<encode_neighbor_cursor>"
+static char* write_neighbor_json(char* p, uint64_t node, const vector<uint64_t>& nodes, const uint64_t* next_cursor) {
+  memcpy(p, "{\"node_id\": ", 12);
+  p = format_uint64(p + 12, node);
+  memcpy(p, ",\"neighbors\": [", 15);
+  p = write_neighbor_list(p + 15, nodes);
+  *p++ = ']';
+  if (next_cursor != nullptr) {
+    memcpy(p, ",\"next_cursor\": \"", 17);
+    p = encode_neighbor_cursor(p + 17, node, *next_cursor);
+    *p++ = '"';
+  }
+  *p++ = '}';
+  return p;
+}
+
+//append the whole get_neighbors response to out, the json is sized first
+//and formatted in place, without intermediate strings
+static void append_neighbor_response(struct mbuf* out, uint64_t node, const vector<uint64_t>& nodes,
+    const uint64_t* next_cursor, bool keep_alive) {
+  size_t size = neighbor_json_size(node, nodes, next_cursor);
+  append_result_http_header(out, 200, status_code_mp[200], size, keep_alive);
+  size_t off = out->len;
+  if (mbuf_append(out, nullptr, size) == size) {
+    write_neighbor_json(out->buf + off, node, nodes, next_cursor);
+  }
+}
+
+//append the header of a chunked transfer encoding response to out
+static void append_chunked_http_header(struct mbuf* out, int status_code, const string& status, bool keep_alive) {
+  append_http_status(out, status_code, status, keep_alive);
+  mbuf_append(out, "\r\nTransfer-Encoding: chunked\r\nContent-Type: application/json\r\n\r\n", 64);
+}
+
+//append nodes to out as one chunk of a chunked response, a list continuing
+//an earlier chunk starts with a comma. nothing for no nodes, an empty chunk
+//ends the response
+static void append_neighbor_chunk(struct mbuf* out, const vector<uint64_t>& nodes, bool first) {
+  if (nodes.empty()) {
+    return;
+  }
+  size_t size = neighbor_list_size(nodes) + (first ? 0 : 1);
+  char head[20];
+  int n = snprintf(head, sizeof(head), "%lX\r\n", (unsigned long)size);
+  mbuf_append(out, head, n);
+  size_t off = out->len;
+  if (mbuf_append(out, nullptr, size) == size) {
+    char* p = out->buf + off;
+    if (!first) {
+      *p++ = ',';
+    }
+    write_neighbor_list(p, nodes);
+  }
+  mbuf_append(out, "\r\n", 2);
+}
+
+//generate batch json result with one status code per operation
+static string gen_batch_json_result(vector<int>& status_codes) {
+  string results;
+  for (int i = 0; i < (int)status_codes.size(); ++i) {
+    results.append(to_string(status_codes[i]) + ",");
+  }
+  if (!results.empty()) {
+    results.pop_back();
+  }
+  return "{\"results\": [" + results + "]}";
 }
 
 //clear a block
@@ -66,6 +451,30 @@ static uint64_t compute_checksum_xor(void* block_ptr) {
   return checksum + CHECKSUM_OFFSET;
 }
 
+//CHECKSUM_* checksum of a block, its first 8 bytes hold the checksum
+static uint64_t compute_block_checksum(void* block_ptr, uint32_t type) {
+  if (type == CHECKSUM_CRC32C) {
+    return crc32c_halves((uint8_t*)block_ptr + 8, BLOCK_SIZE - 8);
+  }
+  return compute_checksum_xor(block_ptr);
+}
+
+//CHECKSUM_* checksum of the first len bytes of a block, for XOR the same as
+//compute_block_checksum when the rest of the block is zeros
+static uint64_t compute_prefix_checksum(const void* block_ptr, uint32_t len, uint32_t type) {
+  const uint8_t* p = (const uint8_t*)block_ptr;
+  if (type == CHECKSUM_CRC32C) {
+    return crc32c_halves(p + 8, len - 8);
+  }
+  uint64_t checksum = 0;
+  for (uint32_t i = 8; i < len; i += 8) {
+    uint64_t word = 0;
+    memcpy(&word, p + i, std::min<uint32_t>(8, len - i));
+    checksum ^= word;
+  }
+  return checksum + CHECKSUM_OFFSET;
+}
+
 static void clear_block(void* block_ptr) {
   memset(block_ptr, 0, BLOCK_SIZE);
 }
@@ -0,0 +1,51 @@
+#ifndef _WORKER_POOL_H
+#define _WORKER_POOL_H
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <vector>
+
+using namespace std;
+
+//fixed size thread pool executing jobs in submission order.
+//the threads are never joined, the pool lives until the process exits
+class worker_pool {
+  private:
+    vector<thread> threads;
+    deque<function<void()> > jobs;
+    mutex jobs_mutex;
+    condition_variable jobs_cv;
+
+    void run() {
+      while (true) {
+        function<void()> job;
+        {
+          unique_lock<mutex> lk(jobs_mutex);
+          jobs_cv.wait(lk, [this]() { return !jobs.empty(); });
+          job = std::move(jobs.front());
+          jobs.pop_front();
+        }
+        job();
+      }
+    }
+
+  public:
+    void start(int n) {
+      for (int i = 0; i < n; ++i) {
+        threads.push_back(thread(&worker_pool::run, this));
+      }
+    }
+
+    void submit(function<void()> job) {
+      {
+        lock_guard<mutex> lk(jobs_mutex);
+        jobs.push_back(std::move(job));
+      }
+      jobs_cv.notify_one();
+    }
+};
+
+#endif